@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -6,16 +7,55 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <ctype.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include "../perfregions.h"
 
 #define ERR(source) (perror(source),\
 		     fprintf(stderr,"%s:%d\n",__FILE__,__LINE__),\
 		     exit(EXIT_FAILURE))
+#define FANIN_CHUNK 65536
+#define FANIN_BURST 16
+#define FANIN_EVENTS 64
+#define ELAPSED(start,end) (((end).tv_sec-(start).tv_sec)+((end).tv_nsec-(start).tv_nsec)*1e-9)
+
+typedef struct source {
+	char *path;
+	int fd;
+	long sessions;
+	long reads;
+	long long bytes;
+	struct timespec first,last;
+} source_t;
+
+volatile sig_atomic_t stop = 0;
 
 void usage(char *name){
 	fprintf(stderr,"USAGE: %s fifo_file\n", name);
+	fprintf(stderr,"       %s fifo_file fifo_file ... | directory\n", name);
+	fprintf(stderr,"       %s -b max_sources seconds\n", name);
+	fprintf(stderr,"More than one fifo or a directory of fifos - read all of them until C-c, report per fifo throughput\n");
+	fprintf(stderr,"-b - fan-in benchmark with 1,2,4 ... max_sources writer processes, each writing for given seconds\n");
 	exit(EXIT_FAILURE);
 }
 
+int sethandler( void (*f)(int), int sigNo) {
+	struct sigaction act;
+	memset(&act, 0, sizeof(struct sigaction));
+	act.sa_handler = f;
+	if (-1==sigaction(sigNo, &act, NULL))
+		return -1;
+	return 0;
+}
+
+void sig_handler(int sig) {
+	stop = 1;
+}
+
 void read_from_fifo(int fifo){
 	ssize_t count;
 	char c;
@@ -25,14 +65,213 @@ void read_from_fifo(int fifo){
 	}while(count>0);
 }
 
-int main(int argc, char** argv) {
+int is_directory(char *path){
+	struct stat st;
+	return !stat(path,&st)&&S_ISDIR(st.st_mode);
+}
+
+/* opens source i unless it is already open and adds it to epfd */
+void watch_source(int epfd, source_t *sources, int i){
+	struct epoll_event ev;
+	if(sources[i].fd<0&&(sources[i].fd=open(sources[i].path,O_RDONLY|O_NONBLOCK))<0) ERR("open");
+	ev.events=EPOLLIN;
+	ev.data.u32=i;
+	if(epoll_ctl(epfd,EPOLL_CTL_ADD,sources[i].fd,&ev)) ERR("epoll_ctl");
+}
+
+/* Reads up to FANIN_BURST chunks, so one busy fifo can not starve the others,
+ * returns 0 on EOF (the last writer is gone), 1 otherwise */
+int drain_source(source_t *s, char *buf){
+	ssize_t count;
+	for(int i=0;i<FANIN_BURST;i++){
+		count=TEMP_FAILURE_RETRY(read(s->fd,buf,FANIN_CHUNK));
+		if(count<0&&errno==EAGAIN) return 1;
+		if(count<0) ERR("read");
+		if(0==count) return 0;
+		if(0==s->bytes&&clock_gettime(CLOCK_MONOTONIC,&s->first)) ERR("clock_gettime");
+		if(clock_gettime(CLOCK_MONOTONIC,&s->last)) ERR("clock_gettime");
+		s->bytes+=count;
+		s->reads++;
+		if(count<FANIN_CHUNK) return 1;
+	}
+	return 1;
+}
+
+/* All fifos are opened O_NONBLOCK (open does not wait for writers) and watched with one epoll.
+ * On EOF a fifo is reopened, a reader opened after the writers left does not see the old
+ * hangup, so the fifo waits for the next writer session. With keepalive 0 (benchmark) a fifo
+ * is closed on EOF and the loop ends when all are closed. */
+void fan_in(source_t *sources, int n, int keepalive){
+	struct epoll_event events[FANIN_EVENTS];
+	char *buf;
+	int epfd,ready,i,open=n;
+	perfMark_t mark;
+	if(NULL==(buf=malloc(FANIN_CHUNK))) ERR("malloc");
+	if((epfd=epoll_create1(EPOLL_CLOEXEC))<0) ERR("epoll_create1");
+	for(i=0;i<n;i++) watch_source(epfd,sources,i);
+	while(!stop&&open>0){
+		if((ready=epoll_wait(epfd,events,FANIN_EVENTS,-1))<0){
+			if(EINTR==errno) continue;
+			ERR("epoll_wait");
+		}
+		perf_begin(&mark,"drain_source");
+		for(int e=0;e<ready;e++){
+			source_t *s=&sources[events[e].data.u32];
+			if(drain_source(s,buf)) continue;
+			s->sessions++;
+			if(epoll_ctl(epfd,EPOLL_CTL_DEL,s->fd,NULL)) ERR("epoll_ctl");
+			if(close(s->fd)) ERR("close");
+			s->fd=-1;
+			if(keepalive) watch_source(epfd,sources,events[e].data.u32);
+			else open--;
+		}
+		perf_end(&mark);
+	}
+	for(i=0;i<n;i++) if(sources[i].fd>=0&&close(sources[i].fd)) ERR("close");
+	if(close(epfd)) ERR("close");
+	free(buf);
+}
+
+void report(source_t *sources, int n, double seconds){
+	long long total=0;
+	double active;
+	printf("fifo\tsessions\treads\tbytes\tMB/s\n");
+	for(int i=0;i<n;i++){
+		active=ELAPSED(sources[i].first,sources[i].last);
+		printf("%s\t%ld\t%ld\t%lld\t%.1f\n",sources[i].path,sources[i].sessions,sources[i].reads,sources[i].bytes,
+			active>0?sources[i].bytes/active/(1024*1024):0.0);
+		total+=sources[i].bytes;
+	}
+	printf("total\t%lld bytes in %.3f s, %.1f MB/s\n",total,seconds,seconds>0?total/seconds/(1024*1024):0.0);
+}
+
+/* fifos given on the command line (created if missing) or all fifos in one directory */
+int list_sources(int argc, char **argv, source_t **sources){
+	struct stat st;
+	struct dirent *entry;
+	DIR *dir;
+	int n=0,size=argc;
+	if(NULL==(*sources=calloc(size,sizeof(source_t)))) ERR("calloc");
+	if(2==argc&&is_directory(argv[1])){
+		if(NULL==(dir=opendir(argv[1]))) ERR("opendir");
+		while((errno=0,entry=readdir(dir))!=NULL){
+			char *path;
+			if(asprintf(&path,"%s/%s",argv[1],entry->d_name)<0) ERR("asprintf");
+			if(stat(path,&st)) ERR("stat");
+			if(!S_ISFIFO(st.st_mode)){
+				free(path);
+				continue;
+			}
+			if(n==size&&NULL==(*sources=realloc(*sources,sizeof(source_t)*(size*=2)))) ERR("realloc");
+			memset(&(*sources)[n],0,sizeof(source_t));
+			(*sources)[n].fd=-1;
+			(*sources)[n++].path=path;
+		}
+		if(errno) ERR("readdir");
+		if(closedir(dir)) ERR("closedir");
+		return n;
+	}
+	for(int i=1;i<argc;i++){
+		if(mkfifo(argv[i], S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP)<0)
+			if(errno!=EEXIST) ERR("create fifo");
+		if(NULL==((*sources)[n].path=strdup(argv[i]))) ERR("strdup");
+		(*sources)[n++].fd=-1;
+	}
+	return n;
+}
+
+void writer_work(char *path, double seconds){
+	char *buf;
 	int fifo;
-	if(argc!=2) usage(argv[0]);
+	struct timespec start,now;
+	if(NULL==(buf=malloc(FANIN_CHUNK))) ERR("malloc");
+	memset(buf,'a',FANIN_CHUNK);
+	if((fifo=open(path,O_WRONLY))<0) ERR("open");
+	if(clock_gettime(CLOCK_MONOTONIC,&start)) ERR("clock_gettime");
+	do{
+		if(TEMP_FAILURE_RETRY(write(fifo,buf,FANIN_CHUNK))<0) ERR("write");
+		if(clock_gettime(CLOCK_MONOTONIC,&now)) ERR("clock_gettime");
+	}while(ELAPSED(start,now)<seconds);
+	if(close(fifo)) ERR("close");
+	free(buf);
+}
+
+/* n writer processes, one private fifo each in a temporary directory, one writer session per fifo */
+void benchmark(int max, double seconds){
+	char dir[]="/tmp/fanin.XXXXXX";
+	struct timespec start,end;
+	source_t *sources;
+	long long total;
+	printf("sources\tMB/s\tper source MB/s\n");
+	if(NULL==mkdtemp(dir)) ERR("mkdtemp");
+	for(int n=1;n<=max;n=n<max&&2*n>max?max:2*n){
+		if(NULL==(sources=calloc(n,sizeof(source_t)))) ERR("calloc");
+		for(int i=0;i<n;i++){
+			if(asprintf(&sources[i].path,"%s/%d",dir,i)<0) ERR("asprintf");
+			if(mkfifo(sources[i].path,S_IRUSR|S_IWUSR)) ERR("mkfifo");
+			if((sources[i].fd=open(sources[i].path,O_RDONLY|O_NONBLOCK))<0) ERR("open");
+		}
+		fflush(stdout);
+		if(clock_gettime(CLOCK_MONOTONIC,&start)) ERR("clock_gettime");
+		for(int i=0;i<n;i++)
+			switch(fork()){
+				case 0:
+					for(int j=0;j<n;j++) if(close(sources[j].fd)) ERR("close");
+					writer_work(sources[i].path,seconds);
+					exit(EXIT_SUCCESS);
+				case -1: ERR("fork");
+			}
+		fan_in(sources,n,0);
+		if(clock_gettime(CLOCK_MONOTONIC,&end)) ERR("clock_gettime");
+		while(wait(NULL)>0);
+		total=0;
+		for(int i=0;i<n;i++){
+			total+=sources[i].bytes;
+			if(unlink(sources[i].path)) ERR("unlink");
+			free(sources[i].path);
+		}
+		free(sources);
+		printf("%d\t%.1f\t%.1f\n",n,total/ELAPSED(start,end)/(1024*1024),total/ELAPSED(start,end)/(1024*1024)/n);
+		if(stop||n==max) break;
+	}
+	if(rmdir(dir)) ERR("rmdir");
+}
+
+int main(int argc, char** argv) {
+	int fifo,n;
+	source_t *sources;
+	struct timespec start,end;
+	perfMark_t mark;
+	if(argc<2) usage(argv[0]);
+	if(!strcmp(argv[1],"-b")){
+		if(argc!=4||atoi(argv[2])<=0||atof(argv[3])<=0) usage(argv[0]);
+		perf_init();
+		benchmark(atoi(argv[2]),atof(argv[3]));
+		return EXIT_SUCCESS;
+	}
+	if(argc>2||is_directory(argv[1])){
+		if((n=list_sources(argc,argv,&sources))==0){
+			fprintf(stderr,"No fifos in %s\n",argv[1]);
+			return EXIT_FAILURE;
+		}
+		if(sethandler(sig_handler,SIGINT)||sethandler(sig_handler,SIGTERM)) ERR("Setting SIGINT handler");
+		perf_init();
+		if(clock_gettime(CLOCK_MONOTONIC,&start)) ERR("clock_gettime");
+		fan_in(sources,n,1);
+		if(clock_gettime(CLOCK_MONOTONIC,&end)) ERR("clock_gettime");
+		report(sources,n,ELAPSED(start,end));
+		for(int i=0;i<n;i++) free(sources[i].path);
+		free(sources);
+		return EXIT_SUCCESS;
+	}
 
 	if(mkfifo(argv[1], S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP)<0)
 		if(errno!=EEXIST) ERR("create fifo");
 	if((fifo=open(argv[1],O_RDONLY))<0)ERR("open");
-	read_from_fifo(fifo);	
+	perf_init();
+	perf_begin(&mark,"read_from_fifo");
+	read_from_fifo(fifo);
+	perf_end(&mark);	
 	if(close(fifo)<0) ERR("close fifo:");
 	return EXIT_SUCCESS;
 }
@@ -50,4 +289,5 @@ Isn't writing char by char inefficient?
 Ad: In this program we write to buffered stream, the extra overhead is minimal, but when you write chat by char to unbuffered descriptor then the overhead becomes a serious problem.
 How can you tell that the link does not have and will not have any more data for the reader?
 Ad: EOF - broken pipe detected on read occurs when all writing processes/threads disconnect the link and the buffer is depleted.
-*/
\ No newline at end of file
+With more than one fifo (or a directory holding fifos) the program becomes a fan-in reader: all fifos are opened with O_NONBLOCK, so the open does not wait for writers, and watched by one epoll. Ready fifos are drained in FANIN_CHUNK reads, at most FANIN_BURST of them in a row. EOF ends only the current writer session, the fifo is closed and opened again and waits for the next writer. C-c prints bytes and MB/s of every fifo. "-b max seconds" runs 1,2,4 ... max writer processes against it to show how the aggregate throughput grows with the number of sources until the reader runs out of CPU.
+*/
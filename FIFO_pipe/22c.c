@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -6,6 +7,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <ctype.h>
+#include "../perfregions.h"
 #include <limits.h>
 
 #define ERR(source) (perror(source),\
@@ -32,12 +34,16 @@ void read_from_fifo(int fifo){
 
 int main(int argc, char** argv) {
 	int fifo;
+	perfMark_t mark;
 	if(argc!=2) usage(argv[0]);
 
 	if(mkfifo(argv[1], S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP)<0)
 		if(errno!=EEXIST) ERR("create fifo");
 	if((fifo=open(argv[1],O_RDONLY))<0)ERR("open");
-	read_from_fifo(fifo);	
+	perf_init();
+	perf_begin(&mark,"read_from_fifo");
+	read_from_fifo(fifo);
+	perf_end(&mark);	
 	if(close(fifo)<0) ERR("close fifo:");
 	if(unlink(argv[1])<0)ERR("remove fifo:");
 	return EXIT_SUCCESS;
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,10 +8,14 @@
 #include <string.h>
 #include <time.h>
 #include <limits.h>
+#include "../perfregions.h"
+#include "../prng.h"
 #define ERR(source) (fprintf(stderr,"%s:%d\n",__FILE__,__LINE__),\
                      perror(source),kill(0,SIGKILL),\
 		     exit(EXIT_FAILURE))
 
+prng_t rng;
+
 int sethandler( void (*f)(int), int sigNo) {
 	struct sigaction act;
 	memset(&act, 0, sizeof(struct sigaction));
@@ -33,16 +38,20 @@ void sigchld_handler(int sig) {
 }
 
 void child_work(int fd, int R) {
-	srand(getpid());
-	char c = 'a'+rand()%('z'-'a');
+	perfMark_t mark;
+	perf_begin(&mark,"child_work");
+	char c = 'a'+prng_below(&rng,'z'-'a');
 	if(write(R,&c,1) <0) ERR("write to R");
+	perf_end(&mark);
 }
 
 void parent_work(int n,int *fds,int R) {
 	char c;
 	int status;
-	srand(getpid());
+	perfMark_t mark;
+	perf_begin(&mark,"parent_read");
 	while((status=read(R,&c,1))==1) printf("%c",c);
+	perf_end(&mark);
 	if(status<0) ERR("read from R");
 	printf("\n");
 	
@@ -65,6 +74,7 @@ void create_children_and_pipes(int n,int *fds,int R) {
 
 			case -1: ERR("Fork:");
 		}
+		prng_jump(&rng);
 		if(close(tmpfd[0])) ERR("close");
 		fds[--n]=tmpfd[1];
 	}
@@ -83,6 +93,8 @@ int main(int argc, char** argv) {
 	if (n<=0||n>10) usage(argv[0]);
 	if(pipe(R)) ERR("pipe");
 	if(NULL==(fds=(int*)malloc(sizeof(int)*n))) ERR("malloc");
+	perf_init();
+	prng_seed(&rng,prng_master());
 	if(sethandler(sigchld_handler,SIGCHLD)) ERR("Seting parent SIGCHLD:");
 	create_children_and_pipes(n,fds,R[1]);
 	if(close(R[1])) ERR("close");
@@ -8,14 +8,22 @@
 #include <string.h>
 #include <time.h>
 #include <limits.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include "../perfregions.h"
+#include "../prng.h"
 #define ERR(source) (fprintf(stderr,"%s:%d\n",__FILE__,__LINE__),\
                      perror(source),kill(0,SIGKILL),\
 		     exit(EXIT_FAILURE))
 
 //MAX_BUFF must be in one byte range
 #define MAX_BUFF 200
+#define REQ_RING 64
 
 volatile sig_atomic_t last_signal = 0;
+volatile sig_atomic_t children_exited = 0;
+/* killRng is used only by the SIGINT handler, an interrupted update of rng can not be seen there */
+prng_t rng,killRng;
 
 int sethandler( void (*f)(int), int sigNo) {
 	struct sigaction act;
@@ -31,7 +39,7 @@ void sig_handler(int sig) {
 }
 
 void sig_killme(int sig) {
-	if(rand()%5==0) 
+	if(prng_below(&killRng,5)==0)
 		exit(EXIT_SUCCESS);
 }
 
@@ -40,6 +48,7 @@ void sigchld_handler(int sig) {
 	pid_t pid;
 	for(;;){
 		pid=waitpid(0, NULL, WNOHANG);
+		if(pid>0) children_exited++;
 		if(0==pid) return;
 		if(0>=pid) {
 			if(ECHILD==errno) return;
@@ -48,63 +57,237 @@ void sigchld_handler(int sig) {
 	}
 }
 
-void child_work(int fd, int R) {
-	char c,buf[MAX_BUFF+1];
-	unsigned char s;
-	srand(getpid());
+/* Requests queued in a child, the parent never sends more than REQ_RING to one child */
+typedef struct request {
+	char c;
+	int left;
+} request_t;
+
+/* Parent to child: c - letter to send back (0 - credit only), credit - bytes of R granted */
+typedef struct grant {
+	char c;
+	int credit;
+} grant_t;
+
+/* Child to parent header, followed by len bytes, last marks the final frame of a request */
+typedef struct frame {
+	unsigned char id;
+	unsigned char len;
+	unsigned char last;
+} frame_t;
+
+typedef struct childStats {
+	int window;
+	int returned;
+	long requests;
+	long completed;
+	long bytes;
+	long frames;
+	double latSum;
+	double latMax;
+	int head,tail;
+	struct timespec issued[REQ_RING];
+} childStats_t;
+
+/* The child writes only what the parent has granted, so its frames always fit in R and
+ * the write never blocks in the middle of a burst. Output of queued requests is batched
+ * into frames of up to MAX_BUFF bytes. */
+void child_work(int id, int fd, int R) {
+	char buf[sizeof(frame_t)+MAX_BUFF];
+	frame_t *h=(frame_t*)buf;
+	request_t queue[REQ_RING];
+	grant_t g;
+	int head=0,tail=0,credit=0,len;
+	ssize_t status;
+	perfMark_t mark;
 	if(sethandler(sig_killme,SIGINT)) ERR("Setting SIGINT handler in child");
+	h->id=id;
 	for(;;){
-		if(TEMP_FAILURE_RETRY(read(fd,&c,1))<1) ERR("read");
-		s=1+rand()%MAX_BUFF;
-		buf[0]=s;
-		memset(buf+1,c,s);
-		if(TEMP_FAILURE_RETRY(write(R,buf,s+1)) <0) ERR("write to R");
+		while(head!=tail&&credit>(int)sizeof(frame_t)){
+			perf_begin(&mark,"child_write");
+			len=queue[head].left;
+			if(len>MAX_BUFF) len=MAX_BUFF;
+			if(len>credit-(int)sizeof(frame_t)) len=credit-sizeof(frame_t);
+			h->len=len;
+			h->last=(len==queue[head].left);
+			memset(buf+sizeof(frame_t),queue[head].c,len);
+			if(TEMP_FAILURE_RETRY(write(R,buf,sizeof(frame_t)+len)) <0) ERR("write to R");
+			credit-=sizeof(frame_t)+len;
+			if((queue[head].left-=len)==0) head=(head+1)%REQ_RING;
+			perf_end(&mark);
+		}
+		if((status=TEMP_FAILURE_RETRY(read(fd,&g,sizeof(grant_t))))==0) return;
+		if(status<(ssize_t)sizeof(grant_t)) ERR("read");
+		credit+=g.credit;
+		if(g.c){
+			queue[tail].c=g.c;
+			queue[tail].left=1+prng_below(&rng,MAX_BUFF);
+			tail=(tail+1)%REQ_RING;
+		}
+	}
+}
+
+double elapsed_ms(struct timespec *start){
+	struct timespec now;
+	if(clock_gettime(CLOCK_MONOTONIC,&now)) ERR("clock_gettime");
+	return ((now.tv_sec-start->tv_sec)+(now.tv_nsec-start->tv_nsec)*1e-9)*1e3;
+}
+
+/* returns 0 if the grant could not be delivered (child is gone) */
+int send_grant(int *fds, childStats_t *stats, int i, char c, int credit){
+	grant_t g={c,credit};
+	if(TEMP_FAILURE_RETRY(write(fds[i],&g,sizeof(grant_t)))!=sizeof(grant_t)) {
+		if(TEMP_FAILURE_RETRY(close(fds[i]))) ERR("close");
+		fds[i]=0;
+		return 0;
+	}
+	if(c){
+		if(clock_gettime(CLOCK_MONOTONIC,&stats[i].issued[stats[i].tail])) ERR("clock_gettime");
+		stats[i].tail=(stats[i].tail+1)%REQ_RING;
+		stats[i].requests++;
+	}
+	return 1;
+}
+
+/* random live child with room in its request queue, -1 if there is none */
+int pick_child(int n, int *fds, childStats_t *stats){
+	int i=prng_below(&rng,n);
+	for(int k=0;k<n;k++,i=(i+1)%n)
+		if(fds[i]&&stats[i].requests-stats[i].completed<REQ_RING-1) return i;
+	return -1;
+}
+
+/* A zero grant to every live child, the grant pipe of a child that has exited fails and is closed */
+void probe_children(int n, int *fds, childStats_t *stats){
+	for(int i=0;i<n;i++)
+		if(fds[i]) send_grant(fds,stats,i,0,0);
+}
+
+/* requests of exited children that will never complete, frames already in R still count as they arrive */
+long lost_requests(int n, int *fds, childStats_t *stats){
+	long lost=0;
+	for(int i=0;i<n;i++)
+		if(!fds[i]) lost+=stats[i].requests-stats[i].completed;
+	return lost;
+}
+
+int live_children(int n, int *fds){
+	int live=0;
+	for(int i=0;i<n;i++) if(fds[i]) live++;
+	return live;
+}
+
+void report(int n, childStats_t *stats, long maxDepth, double depthSum, long reads, int capacity, double ms){
+	double sum=0,sumSq=0,mean;
+	long bytes=0;
+	int active=0;
+	fprintf(stderr,"child requests    bytes  frames  mean ms   max ms\n");
+	for(int i=0;i<n;i++){
+		mean=stats[i].completed?stats[i].latSum/stats[i].completed:0;
+		fprintf(stderr,"%5d %8ld %8ld %7ld %8.3f %8.3f\n",i,stats[i].requests,stats[i].bytes,stats[i].frames,mean,stats[i].latMax);
+		bytes+=stats[i].bytes;
+		if(stats[i].completed){
+			sum+=mean;
+			sumSq+=mean*mean;
+			active++;
+		}
 	}
+	fprintf(stderr,"R depth: max %ld mean %.0f of %d bytes, %.2f MB/s, latency fairness (Jain) %.3f\n",maxDepth,
+		reads?depthSum/reads:0,capacity,ms>0?bytes/ms/1e3:0,sumSq>0?sum*sum/(active*sumSq):1.0);
 }
 
-void parent_work(int n,int *fds,int R) {
-	unsigned char c;
-	char buf[MAX_BUFF];
-	int status,i;
-	srand(getpid());
+/* Every child starts with a window of R capacity / n bytes, the parent returns credit
+ * in batches of half a window as it consumes frames. Bytes in R never exceed the capacity.
+ * With load > 0 the parent issues load requests itself instead of waiting for C-c. A child that
+ * exits (C-c) takes its outstanding requests with it, they are dropped from the target. */
+void parent_work(int n,int *fds,int R,int load) {
+	char buf[MAX_BUFF+1];
+	frame_t h;
+	childStats_t *stats;
+	int status,i,capacity,window,depth,exited=0;
+	long issued=0,sent=0,completed=0,maxDepth=0,reads=0;
+	double depthSum=0,lat;
+	struct timespec start;
+	perfMark_t mark;
 	if(sethandler(sig_handler,SIGINT)) ERR("Setting SIGINT handler in parent");
+	if((capacity=fcntl(R,F_GETPIPE_SZ))<0) ERR("fcntl");
+	window=capacity/n;
+	if(NULL==(stats=calloc(n,sizeof(childStats_t)))) ERR("calloc");
+	if(clock_gettime(CLOCK_MONOTONIC,&start)) ERR("clock_gettime");
+	for(i=0;i<n;i++){
+		stats[i].window=window;
+		send_grant(fds,stats,i,0,window);
+	}
 	for(;;){
 		if(SIGINT==last_signal){
-			i=rand()%n;
-			while(0==fds[i%n]&&i<2*n)i++;
-			i%=n;
-			if(fds[i]){
-				c = 'a'+rand()%('z'-'a');
-				status=TEMP_FAILURE_RETRY(write(fds[i],&c,1));
-				if(status!=1) {
+			if((i=pick_child(n,fds,stats))>=0&&send_grant(fds,stats,i,'a'+prng_below(&rng,'z'-'a'),0)) sent++;
+			last_signal=0;
+		}
+		if(exited!=children_exited){
+			exited=children_exited;
+			probe_children(n,fds,stats);
+		}
+		while(issued<load&&(i=pick_child(n,fds,stats))>=0)
+			if(send_grant(fds,stats,i,'a'+prng_below(&rng,'z'-'a'),0)) issued++,sent++;
+		if(load>0&&completed+lost_requests(n,fds,stats)==sent&&(issued==load||0==live_children(n,fds)))
+			for(i=0;i<n;i++)
+				if(fds[i]){
 					if(TEMP_FAILURE_RETRY(close(fds[i]))) ERR("close");
 					fds[i]=0;
 				}
-			}
-			last_signal=0;
-		}
-		status=read(R,&c,1);
+		status=read(R,&h,sizeof(frame_t));
 		if(status<0&&errno==EINTR) continue;
 		if(status<0) ERR("read header from R");
 		if(0==status) break;
-		if(TEMP_FAILURE_RETRY(read(R,buf,c))<c)ERR("read data from R");
-		buf[(int)c]=0;
-		printf("\n%s\n",buf);
+		if(h.id>=n) ERR("frame from unknown child");
+		perf_begin(&mark,"parent_read");
+		if(ioctl(R,FIONREAD,&depth)) ERR("ioctl");
+		depth+=sizeof(frame_t);
+		if(depth>maxDepth) maxDepth=depth;
+		depthSum+=depth;
+		reads++;
+		if(TEMP_FAILURE_RETRY(read(R,buf,h.len))<h.len)ERR("read data from R");
+		buf[(int)h.len]=0;
+		if(!load) printf("\n%s\n",buf);
+		stats[h.id].bytes+=h.len;
+		stats[h.id].frames++;
+		if(h.last){
+			lat=elapsed_ms(&stats[h.id].issued[stats[h.id].head]);
+			stats[h.id].head=(stats[h.id].head+1)%REQ_RING;
+			stats[h.id].latSum+=lat;
+			if(lat>stats[h.id].latMax) stats[h.id].latMax=lat;
+			stats[h.id].completed++;
+			completed++;
+		}
+		stats[h.id].returned+=sizeof(frame_t)+h.len;
+		if(fds[h.id]&&stats[h.id].returned>=window/2){
+			send_grant(fds,stats,h.id,0,stats[h.id].returned);
+			stats[h.id].returned=0;
+		}
+		perf_end(&mark);
 	}
-	
+	report(n,stats,maxDepth,depthSum,reads,capacity,elapsed_ms(&start));
+	free(stats);
 }
 
 void create_children_and_pipes(int n,int *fds,int R) {
 	int tmpfd[2];
-	int max=n;
+	int max=n,id;
+	prng_t childRng,childKillRng;
 	while (n) {
 		if(pipe(tmpfd)) ERR("pipe");
+		/* both streams of the child are split off before fork, the parent keeps drawing from rng */
+		prng_split(&rng,&childRng);
+		prng_split(&rng,&childKillRng);
 		switch (fork()) {
 			case 0:
+				rng=childRng;
+				killRng=childKillRng;
+				id=n-1;
 				while(n<max) if(fds[n]&&TEMP_FAILURE_RETRY(close(fds[n++]))) ERR("close");
 				free(fds);
 				if(TEMP_FAILURE_RETRY(close(tmpfd[1]))) ERR("close");
-				child_work(tmpfd[0],R);
+				child_work(id,tmpfd[0],R);
 				if(TEMP_FAILURE_RETRY(close(tmpfd[0]))) ERR("close");
 				if(TEMP_FAILURE_RETRY(close(R))) ERR("close");
 				exit(EXIT_SUCCESS);
@@ -117,16 +300,20 @@ void create_children_and_pipes(int n,int *fds,int R) {
 }
 
 void usage(char * name){
-	fprintf(stderr,"USAGE: %s n\n",name);
+	fprintf(stderr,"USAGE: %s n [load]\n",name);
 	fprintf(stderr,"0<n<=10 - number of children\n");
+	fprintf(stderr,"load - number of requests issued by the parent itself, without it requests come from C-c\n");
 	exit(EXIT_FAILURE);
 }
 
 int main(int argc, char** argv) {
-	int n, *fds,R[2];
-	if(2!=argc) usage(argv[0]);
+	int n, *fds,R[2],load=0;
+	if(2!=argc&&3!=argc) usage(argv[0]);
 	n = atoi(argv[1]);
 	if (n<=0||n>10) usage(argv[0]);
+	if (3==argc&&(load=atoi(argv[2]))<=0) usage(argv[0]);
+	perf_init();
+	prng_seed(&rng,prng_master());
 	if(sethandler(SIG_IGN,SIGINT)) ERR("Setting SIGINT handler");
 	if(sethandler(SIG_IGN,SIGPIPE)) ERR("Setting SIGINT handler");
 	if(sethandler(sigchld_handler,SIGCHLD)) ERR("Setting parent SIGCHLD:");
@@ -134,7 +321,7 @@ int main(int argc, char** argv) {
 	if(NULL==(fds=(int*)malloc(sizeof(int)*n))) ERR("malloc");
 	create_children_and_pipes(n,fds,R[1]);
 	if(TEMP_FAILURE_RETRY(close(R[1]))) ERR("close");
-	parent_work(n,fds,R[0]);
+	parent_work(n,fds,R[0],load);
 	while(n--) if(fds[n]&&TEMP_FAILURE_RETRY(close(fds[n]))) ERR("close");
 	if(TEMP_FAILURE_RETRY(close(R[0]))) ERR("close");
 	free(fds);
@@ -170,4 +357,5 @@ Why SIGINT is first ignored in the parent and the proper signal handler function
 Ad: To prevent the premature end of our program due to quick C-c before it is ready to handle it.
 Is SIGCHLD handler absolutely necessary in this code?
 Ad: It won't break the logic, but without it zombi will linger and that is something a good programmer would not accept.
+Flow control: the parent grants every child a budget of bytes in R (window = R capacity / n) through the child's pipe, children send only within their credit and the parent returns credit in batches of half a window as it reads. No writer can block on a full R in the middle of a burst and a chatty child can not take more than its window. Frames carry the child id, the length and the last frame flag, the parent prints per child latency, R depth and fairness at the end. Run with the load argument to measure it under overload.
 */
\ No newline at end of file
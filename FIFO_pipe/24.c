@@ -0,0 +1,419 @@
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <mqueue.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include "../perfregions.h"
+#define ERR(source) (fprintf(stderr,"%s:%d\n",__FILE__,__LINE__),\
+                     perror(source),kill(0,SIGKILL),\
+		     exit(EXIT_FAILURE))
+
+#define SEQPACKET_FRAME 65536
+#define RING_SLOTS 64
+#define RING_FRAME 65536
+#define MQ_MAXMSG 10
+#define MAX_PRODUCERS 256
+#define MAX_MESSAGES 100000
+#define MAX_BYTES (64L*1024*1024)
+
+/* Every message is cut into frames not larger than the atomic unit of the transport,
+ * frames of one producer arrive in order so the consumer only counts bytes per producer */
+typedef struct frame {
+	int producer;
+	int seq;
+	uint32_t offset;
+	uint32_t len;
+	uint64_t sent;
+} frame_t;
+
+typedef struct ringslot {
+	int ready;
+	size_t len;
+	char data[RING_FRAME];
+} ringslot_t;
+typedef struct ring {
+	sem_t empty;
+	sem_t full;
+	sem_t lock;
+	unsigned long head;
+	unsigned long tail;
+	ringslot_t slots[RING_SLOTS];
+} ring_t;
+
+typedef struct channel {
+	int rfd;
+	int wfd;
+	mqd_t mq;
+	ring_t *ring;
+	char name[64];
+	size_t maxframe;
+} channel_t;
+
+/* open is called in the parent before fork, producer_init in every child,
+ * consumer_init in the parent after all children were created */
+typedef struct transport {
+	const char *name;
+	void (*open)(channel_t *);
+	void (*producer_init)(channel_t *);
+	void (*consumer_init)(channel_t *);
+	void (*send)(channel_t *, char *, size_t);
+	size_t (*recv)(channel_t *, char *);
+	void (*producer_close)(channel_t *);
+	void (*consumer_close)(channel_t *);
+} transport_t;
+
+typedef struct result {
+	double elapsed;
+	double cpu;
+	uint64_t p50;
+	uint64_t p99;
+} result_t;
+
+int sethandler( void (*f)(int), int sigNo) {
+	struct sigaction act;
+	memset(&act, 0, sizeof(struct sigaction));
+	act.sa_handler = f;
+	if (-1==sigaction(sigNo, &act, NULL))
+		return -1;
+	return 0;
+}
+
+uint64_t now_ns(void){
+	struct timespec t;
+	if(clock_gettime(CLOCK_MONOTONIC,&t)) ERR("clock_gettime");
+	return (uint64_t)t.tv_sec*1000000000ULL+t.tv_nsec;
+}
+
+ssize_t bulk_read(int fd, char *buf, size_t count){
+	ssize_t c;
+	ssize_t len=0;
+	do{
+		c=TEMP_FAILURE_RETRY(read(fd,buf,count));
+		if(c<0) return c;
+		if(c==0) return len;
+		buf+=c;
+		len+=c;
+		count-=c;
+	}while(count>0);
+	return len;
+}
+
+void noop(channel_t *ch){
+}
+
+void stream_send(channel_t *ch, char *frame, size_t len){
+	if(TEMP_FAILURE_RETRY(write(ch->wfd,frame,len))!=(ssize_t)len) ERR("write");
+}
+/* stream transports keep frames whole because every write is at most PIPE_BUF */
+size_t stream_recv(channel_t *ch, char *frame){
+	frame_t *h=(frame_t*)frame;
+	if(bulk_read(ch->rfd,frame,sizeof(frame_t))!=sizeof(frame_t)) ERR("read header");
+	if(bulk_read(ch->rfd,frame+sizeof(frame_t),h->len)!=h->len) ERR("read data");
+	return sizeof(frame_t)+h->len;
+}
+void close_wfd(channel_t *ch){
+	if(TEMP_FAILURE_RETRY(close(ch->wfd))) ERR("close");
+}
+void close_rfd(channel_t *ch){
+	if(TEMP_FAILURE_RETRY(close(ch->rfd))) ERR("close");
+}
+
+void pipe_open(channel_t *ch){
+	int fds[2];
+	if(pipe(fds)) ERR("pipe");
+	ch->rfd=fds[0];
+	ch->wfd=fds[1];
+	ch->maxframe=PIPE_BUF;
+}
+
+void fifo_open(channel_t *ch){
+	snprintf(ch->name,sizeof(ch->name),"/tmp/ipc_bench.%d",getpid());
+	if(mkfifo(ch->name,S_IRUSR|S_IWUSR)<0) ERR("create fifo");
+	if((ch->rfd=open(ch->name,O_RDONLY|O_NONBLOCK))<0) ERR("open");
+	if(fcntl(ch->rfd,F_SETFL,0)) ERR("fcntl");
+	if((ch->wfd=open(ch->name,O_WRONLY))<0) ERR("open");
+	ch->maxframe=PIPE_BUF;
+}
+/* producers connect by name like independent clients, the consumer keeps its own
+ * write end open so it does not see EOF before the first producer connects */
+void fifo_producer_init(channel_t *ch){
+	close_rfd(ch);
+	close_wfd(ch);
+	if((ch->wfd=open(ch->name,O_WRONLY))<0) ERR("open");
+}
+void fifo_consumer_close(channel_t *ch){
+	close_rfd(ch);
+	close_wfd(ch);
+	if(unlink(ch->name)<0) ERR("remove fifo");
+}
+
+void seqpacket_open(channel_t *ch){
+	int fds[2];
+	if(socketpair(AF_UNIX,SOCK_SEQPACKET,0,fds)) ERR("socketpair");
+	ch->rfd=fds[0];
+	ch->wfd=fds[1];
+	ch->maxframe=SEQPACKET_FRAME;
+}
+void seqpacket_send(channel_t *ch, char *frame, size_t len){
+	if(TEMP_FAILURE_RETRY(send(ch->wfd,frame,len,0))!=(ssize_t)len) ERR("send");
+}
+size_t seqpacket_recv(channel_t *ch, char *frame){
+	ssize_t c;
+	if((c=TEMP_FAILURE_RETRY(recv(ch->rfd,frame,ch->maxframe,0)))<(ssize_t)sizeof(frame_t)) ERR("recv");
+	return c;
+}
+
+void mq_open_channel(channel_t *ch){
+	struct mq_attr attr;
+	FILE *f;
+	long msgsize=8192;
+	if((f=fopen("/proc/sys/fs/mqueue/msgsize_max","r"))){
+		if(fscanf(f,"%ld",&msgsize)!=1) msgsize=8192;
+		fclose(f);
+	}
+	memset(&attr,0,sizeof(attr));
+	attr.mq_maxmsg=MQ_MAXMSG;
+	attr.mq_msgsize=msgsize;
+	snprintf(ch->name,sizeof(ch->name),"/ipc_bench.%d",getpid());
+	if((ch->mq=mq_open(ch->name,O_RDWR|O_CREAT|O_EXCL,0600,&attr))==(mqd_t)-1) ERR("mq_open");
+	ch->maxframe=msgsize;
+}
+void mq_send_frame(channel_t *ch, char *frame, size_t len){
+	if(TEMP_FAILURE_RETRY(mq_send(ch->mq,frame,len,0))) ERR("mq_send");
+}
+size_t mq_recv_frame(channel_t *ch, char *frame){
+	ssize_t c;
+	if((c=TEMP_FAILURE_RETRY(mq_receive(ch->mq,frame,ch->maxframe,NULL)))<(ssize_t)sizeof(frame_t)) ERR("mq_receive");
+	return c;
+}
+void mq_producer_close(channel_t *ch){
+	if(mq_close(ch->mq)) ERR("mq_close");
+}
+void mq_consumer_close(channel_t *ch){
+	if(mq_close(ch->mq)) ERR("mq_close");
+	if(mq_unlink(ch->name)) ERR("mq_unlink");
+}
+
+/* Multi-producer ring in shared memory. Producers reserve a slot under the lock and copy
+ * outside of it, the consumer takes slots in order and waits for the ready flag. */
+void ring_open(channel_t *ch){
+	ring_t *r;
+	if(MAP_FAILED==(r=mmap(NULL,sizeof(ring_t),PROT_READ|PROT_WRITE,MAP_SHARED|MAP_ANONYMOUS,-1,0))) ERR("mmap");
+	if(sem_init(&r->empty,1,RING_SLOTS)||sem_init(&r->full,1,0)||sem_init(&r->lock,1,1)) ERR("sem_init");
+	r->head=r->tail=0;
+	ch->ring=r;
+	ch->maxframe=RING_FRAME;
+}
+void ring_send(channel_t *ch, char *frame, size_t len){
+	ring_t *r=ch->ring;
+	ringslot_t *slot;
+	if(TEMP_FAILURE_RETRY(sem_wait(&r->empty))) ERR("sem_wait");
+	if(TEMP_FAILURE_RETRY(sem_wait(&r->lock))) ERR("sem_wait");
+	slot=&r->slots[r->head++%RING_SLOTS];
+	if(sem_post(&r->lock)) ERR("sem_post");
+	memcpy(slot->data,frame,len);
+	slot->len=len;
+	__atomic_store_n(&slot->ready,1,__ATOMIC_RELEASE);
+	if(sem_post(&r->full)) ERR("sem_post");
+}
+size_t ring_recv(channel_t *ch, char *frame){
+	ring_t *r=ch->ring;
+	ringslot_t *slot;
+	size_t len;
+	if(TEMP_FAILURE_RETRY(sem_wait(&r->full))) ERR("sem_wait");
+	slot=&r->slots[r->tail++%RING_SLOTS];
+	while(!__atomic_load_n(&slot->ready,__ATOMIC_ACQUIRE)) sched_yield();
+	len=slot->len;
+	memcpy(frame,slot->data,len);
+	__atomic_store_n(&slot->ready,0,__ATOMIC_RELAXED);
+	if(sem_post(&r->empty)) ERR("sem_post");
+	return len;
+}
+void ring_consumer_close(channel_t *ch){
+	if(sem_destroy(&ch->ring->empty)||sem_destroy(&ch->ring->full)||sem_destroy(&ch->ring->lock)) ERR("sem_destroy");
+	if(munmap(ch->ring,sizeof(ring_t))) ERR("munmap");
+}
+
+transport_t transports[]={
+	{"fifo",fifo_open,fifo_producer_init,noop,stream_send,stream_recv,close_wfd,fifo_consumer_close},
+	{"pipe",pipe_open,close_rfd,close_wfd,stream_send,stream_recv,close_wfd,close_rfd},
+	{"seqpacket",seqpacket_open,close_rfd,close_wfd,seqpacket_send,seqpacket_recv,close_wfd,close_rfd},
+	{"mqueue",mq_open_channel,noop,noop,mq_send_frame,mq_recv_frame,mq_producer_close,mq_consumer_close},
+	{"shmring",ring_open,noop,noop,ring_send,ring_recv,noop,ring_consumer_close},
+};
+#define TRANSPORT_COUNT (int)(sizeof(transports)/sizeof(transports[0]))
+
+void producer_work(transport_t *t, channel_t *ch, int id, int go, size_t msgsize, int messages){
+	char *frame;
+	frame_t *h;
+	size_t payload=ch->maxframe-sizeof(frame_t),len;
+	char c,region[PERF_NAMELEN];
+	perfMark_t mark;
+	if(NULL==(frame=malloc(ch->maxframe))) ERR("malloc");
+	memset(frame,'a'+id%('z'-'a'),ch->maxframe);
+	h=(frame_t*)frame;
+	h->producer=id;
+	t->producer_init(ch);
+	if(TEMP_FAILURE_RETRY(read(go,&c,1))<0) ERR("read");
+	snprintf(region,sizeof(region),"%s send",t->name);
+	perf_begin(&mark,region);
+	for(h->seq=0;h->seq<messages;h->seq++){
+		h->sent=now_ns();
+		for(h->offset=0;h->offset<msgsize;h->offset+=len){
+			len=msgsize-h->offset<payload?msgsize-h->offset:payload;
+			h->len=len;
+			t->send(ch,frame,sizeof(frame_t)+len);
+		}
+	}
+	perf_end(&mark);
+	t->producer_close(ch);
+	free(frame);
+}
+
+int compare_u64(const void *a, const void *b){
+	uint64_t x=*(const uint64_t*)a,y=*(const uint64_t*)b;
+	return x<y?-1:x>y;
+}
+
+double cpu_seconds(int who){
+	struct rusage ru;
+	if(getrusage(who,&ru)) ERR("getrusage");
+	return ru.ru_utime.tv_sec+ru.ru_stime.tv_sec+(ru.ru_utime.tv_usec+ru.ru_stime.tv_usec)*1e-6;
+}
+
+/* Producers block on the go pipe until all of them exist, the clock starts when it is closed */
+result_t run(transport_t *t, size_t msgsize, int producers, int messages){
+	channel_t ch;
+	result_t res;
+	int go[2],done=0,total=producers*messages;
+	uint64_t *latency,*start,start_time;
+	size_t *received;
+	char *frame,region[PERF_NAMELEN];
+	double cpu_self,cpu_children;
+	perfMark_t mark;
+	memset(&ch,0,sizeof(ch));
+	t->open(&ch);
+	if(pipe(go)) ERR("pipe");
+	fflush(stdout);
+	for(int i=0;i<producers;i++)
+		switch(fork()){
+			case 0:
+				if(TEMP_FAILURE_RETRY(close(go[1]))) ERR("close");
+				producer_work(t,&ch,i,go[0],msgsize,messages);
+				exit(EXIT_SUCCESS);
+			case -1: ERR("fork");
+		}
+	t->consumer_init(&ch);
+	if(TEMP_FAILURE_RETRY(close(go[0]))) ERR("close");
+	if(NULL==(latency=malloc(sizeof(uint64_t)*total))||NULL==(start=calloc(producers,sizeof(uint64_t)))
+		||NULL==(received=calloc(producers,sizeof(size_t)))||NULL==(frame=malloc(ch.maxframe))) ERR("malloc");
+	cpu_self=cpu_seconds(RUSAGE_SELF);
+	cpu_children=cpu_seconds(RUSAGE_CHILDREN);
+	start_time=now_ns();
+	if(TEMP_FAILURE_RETRY(close(go[1]))) ERR("close");
+	snprintf(region,sizeof(region),"%s recv",t->name);
+	perf_begin(&mark,region);
+	while(done<total){
+		frame_t *h=(frame_t*)frame;
+		t->recv(&ch,frame);
+		if(h->producer<0||h->producer>=producers||h->offset!=received[h->producer]) ERR("frame out of order");
+		if(0==h->offset) start[h->producer]=h->sent;
+		received[h->producer]+=h->len;
+		if(received[h->producer]==msgsize){
+			latency[done++]=now_ns()-start[h->producer];
+			received[h->producer]=0;
+		}
+	}
+	perf_end(&mark);
+	res.elapsed=(now_ns()-start_time)*1e-9;
+	while(TEMP_FAILURE_RETRY(wait(NULL))>0);
+	res.cpu=cpu_seconds(RUSAGE_SELF)-cpu_self+cpu_seconds(RUSAGE_CHILDREN)-cpu_children;
+	t->consumer_close(&ch);
+	qsort(latency,total,sizeof(uint64_t),compare_u64);
+	res.p50=latency[total/2];
+	res.p99=latency[(int)(total*0.99)];
+	free(latency);
+	free(start);
+	free(received);
+	free(frame);
+	return res;
+}
+
+void usage(char *name){
+	fprintf(stderr,"USAGE: %s [transport|all] [size|all] [producers|all] [messages]\n",name);
+	fprintf(stderr,"transport - fifo, pipe, seqpacket, mqueue or shmring\n");
+	fprintf(stderr,"size - message size in bytes [1,1048576]\n");
+	fprintf(stderr,"producers - number of producer processes [1,%d]\n",MAX_PRODUCERS);
+	fprintf(stderr,"messages - messages per producer, derived from size and producers by default\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char** argv) {
+	size_t sizes[]={1,64,1024,4096,65536,1048576};
+	int counts[]={1,4,16,64,256};
+	int nsizes=sizeof(sizes)/sizeof(sizes[0]),ncounts=sizeof(counts)/sizeof(counts[0]);
+	int tfirst=0,tlast=TRANSPORT_COUNT,messages=0;
+	if(argc>5) usage(argv[0]);
+	perf_init();
+	if(argc>=2&&strcmp(argv[1],"all")){
+		for(tfirst=0;tfirst<TRANSPORT_COUNT&&strcmp(argv[1],transports[tfirst].name);tfirst++);
+		if(tfirst==TRANSPORT_COUNT) usage(argv[0]);
+		tlast=tfirst+1;
+	}
+	if(argc>=3&&strcmp(argv[2],"all")){
+		sizes[0]=atol(argv[2]);
+		if(sizes[0]<1||sizes[0]>1048576) usage(argv[0]);
+		nsizes=1;
+	}
+	if(argc>=4&&strcmp(argv[3],"all")){
+		counts[0]=atoi(argv[3]);
+		if(counts[0]<1||counts[0]>MAX_PRODUCERS) usage(argv[0]);
+		ncounts=1;
+	}
+	if(argc>=5&&(messages=atoi(argv[4]))<=0) usage(argv[0]);
+	if(sethandler(SIG_IGN,SIGPIPE)) ERR("Setting SIGPIPE handler");
+	printf("transport\tsize\tproducers\tmessages\tMB/s\tmsg/s\tp50[us]\tp99[us]\tcpu[us/msg]\n");
+	for(int t=tfirst;t<tlast;t++)
+		for(int s=0;s<nsizes;s++)
+			for(int p=0;p<ncounts;p++){
+				int m=messages;
+				if(!m){
+					long bytes=MAX_BYTES/((long)sizes[s]*counts[p]);
+					m=MAX_MESSAGES/counts[p];
+					if(bytes<m) m=bytes;
+					if(m<1) m=1;
+				}
+				result_t r=run(&transports[t],sizes[s],counts[p],m);
+				double n=(double)m*counts[p];
+				printf("%s\t%zu\t%d\t%d\t%.2f\t%.0f\t%.1f\t%.1f\t%.2f\n",transports[t].name,sizes[s],counts[p],m,
+					n*sizes[s]/r.elapsed/(1024*1024),n/r.elapsed,r.p50*1e-3,r.p99*1e-3,r.cpu*1e6/n);
+				fflush(stdout);
+			}
+	return EXIT_SUCCESS;
+}
+/*
+All programs of this tutorial move framed messages from many producers to one consumer, this program runs the same workload over five transports to compare them.
+Transports are plugged in with the transport_t table of functions, adding a new one means writing its open, send and recv and appending a row to the table.
+Why messages are cut into frames?
+Ad: Only writes of at most PIPE_BUF bytes are atomic on fifos and pipes, a larger write from one producer can be interleaved with data from the others. Each transport has its own atomic unit - a packet for seqpacket socket, a message for the queue (msgsize_max) and a slot for the ring.
+Why the consumer does not need to reorder frames?
+Ad: All five transports keep the order of frames sent by one process, it is enough to count received bytes per producer.
+Why producers wait on the go pipe?
+Ad: Forking 256 processes takes time, without the barrier first producers would be measured alone. Closing the write end of the go pipe wakes all of them at once (EOF).
+Latency is counted from the moment the producer starts sending a message till the consumer receives its last frame, CPU cost includes both the consumer and all producers.
+*/
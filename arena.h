@@ -0,0 +1,106 @@
+#ifndef ARENA_H
+#define ARENA_H
+/*
+Buffer arena for large I/O buffers (16.c, 21.c).
+The whole region is reserved once, buffers of one fixed size are handed out from it and returned to a free list instead of the heap, so a buffer released and taken again does not fault its pages in again.
+The region is mapped with MAP_HUGETLB if the system has huge pages reserved (vm.nr_hugepages), otherwise it is a regular mapping with MADV_HUGEPAGE (transparent huge pages), if that is refused too it stays on normal pages. With ARENA_POPULATE the pages are faulted in at reservation time, outside of the timed I/O path.
+arena_stats prints the number of page faults taken since arena_init, compare runs with ARENA_NOHUGE environment variable set to see the savings.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#define ARENA_HUGEPAGE (2UL*1024*1024)
+#define ARENA_MINALIGN 64
+#define ARENA_POPULATE 1
+
+typedef enum arenaPages { ARENA_NORMAL, ARENA_THP, ARENA_HUGETLB } arenaPages_t;
+
+typedef struct arena {
+	char *base;
+	size_t size;
+	size_t stride;
+	int count;
+	int nfree;
+	int *freeList;
+	arenaPages_t pages;
+	long allocs;
+	long recycled;
+	unsigned char *touched;
+	long minflt;
+	long majflt;
+} arena_t;
+
+static void arena_faults(long *minflt, long *majflt) {
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	*minflt = ru.ru_minflt;
+	*majflt = ru.ru_majflt;
+}
+
+/* Reserves count buffers of size bytes aligned to align (0 - cache line), returns -1 on failure */
+static int arena_init(arena_t *a, size_t size, int count, size_t align, int flags) {
+	int populate = (flags & ARENA_POPULATE) ? MAP_POPULATE : 0;
+	if (align < ARENA_MINALIGN) align = ARENA_MINALIGN;
+	memset(a, 0, sizeof(arena_t));
+	arena_faults(&a->minflt, &a->majflt);
+	a->stride = (size + align - 1) / align * align;
+	a->count = count;
+	a->size = (a->stride * count + ARENA_HUGEPAGE - 1) / ARENA_HUGEPAGE * ARENA_HUGEPAGE;
+	a->base = MAP_FAILED;
+	if (getenv("ARENA_NOHUGE") == NULL) {
+		a->base = mmap(NULL, a->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | populate, -1, 0);
+		a->pages = ARENA_HUGETLB;
+	}
+	if (a->base == MAP_FAILED) {
+		a->pages = ARENA_NORMAL;
+		/* populate only after madvise, otherwise the pages are already small */
+		if ((a->base = mmap(NULL, a->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+			return -1;
+		if (getenv("ARENA_NOHUGE") == NULL && madvise(a->base, a->size, MADV_HUGEPAGE) == 0)
+			a->pages = ARENA_THP;
+		if (populate)
+			for (size_t off = 0; off < a->size; off += 4096) a->base[off] = 0;
+	}
+	if ((a->freeList = malloc(sizeof(int) * count)) == NULL || (a->touched = calloc(count, 1)) == NULL) {
+		munmap(a->base, a->size);
+		return -1;
+	}
+	for (int i = 0; i < count; i++) a->freeList[i] = count - 1 - i;
+	a->nfree = count;
+	return 0;
+}
+
+/* returns NULL when all buffers are taken */
+static char *arena_alloc(arena_t *a) {
+	int i;
+	if (a->nfree == 0) return NULL;
+	i = a->freeList[--a->nfree];
+	a->allocs++;
+	if (a->touched[i]) a->recycled++;
+	a->touched[i] = 1;
+	return a->base + a->stride * i;
+}
+
+static void arena_free(arena_t *a, char *buf) {
+	if (buf == NULL) return;
+	a->freeList[a->nfree++] = (buf - a->base) / a->stride;
+}
+
+static void arena_stats(arena_t *a, FILE *out) {
+	static const char *names[] = { "4k pages", "transparent huge pages", "MAP_HUGETLB" };
+	long minflt, majflt;
+	arena_faults(&minflt, &majflt);
+	fprintf(out, "arena: %d x %zu bytes in %zu bytes of %s, %ld allocations (%ld recycled), %ld minor and %ld major faults\n",
+		a->count, a->stride, a->size, names[a->pages], a->allocs, a->recycled, minflt - a->minflt, majflt - a->majflt);
+}
+
+static void arena_destroy(arena_t *a) {
+	munmap(a->base, a->size);
+	free(a->freeList);
+	free(a->touched);
+}
+
+#endif
@@ -10,29 +10,144 @@
 #include <fcntl.h>
 #include <signal.h>
 #include <time.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include "../arena.h"
+#include "../perfregions.h"
+#include "../prng.h"
 #define BLOCKS 3
+#define PLAN_WINDOW 64
+#define PLAN_MEMORY (64 * 1024 * 1024)
+#define MAP_PREFETCH 8
+#define PART_ROUND 64
+#define ELAPSED(start,end) ((end).tv_sec-(start).tv_sec)+(((end).tv_nsec - (start).tv_nsec) * 1.0e-9)
 #define SHIFT(counter, x) ((counter + x) % BLOCKS)
+struct plan {
+	int count;
+	int *source;
+	int *target;
+};
+struct blockref {
+	int block;
+	int transfer;
+};
+struct blockstate {
+	int window;
+	int writer;
+	int reader;
+};
+/* CLOCK cache of blocks, slot[b] is the slot holding block b or -1 */
+struct blockcache {
+	int capacity;
+	int blocksize;
+	int used;
+	int hand;
+	int *block;
+	int *slot;
+	char *dirty;
+	char *referenced;
+	char **data;
+	long hits;
+	long misses;
+	long reads;
+	long writes;
+};
+/* Blocks written by a worker into a partition it does not own, applied by the owner next round */
+struct message {
+	int block;
+	int sender;
+	int seq;
+	char *data;
+};
+struct inbox {
+	pthread_mutex_t mutex;
+	struct message *messages;
+	int count;
+	int size;
+};
+struct worker {
+	pthread_t tid;
+	int id;
+	int workers;
+	int fd;
+	int bcount;
+	int bsize;
+	int first;
+	int last;
+	int iterations;
+	int rounds;
+	prng_t rng;
+	char *buffer[BLOCKS];
+	struct inbox *inboxes;
+	pthread_barrier_t *barrier;
+	int *stop;
+	long sent;
+};
 void error(char *);
 void usage(char *);
 void siginthandler(int);
 void sethandler(void (*)(int), int);
 off_t getfilelength(int);
+int getdirectalign(int);
+int opendirect(char *, int *);
+void allocbuffers(char **, int, arena_t *);
+long residentpages(int, long *);
 void fillaiostructs(struct aiocb *, char **, int, int);
 void suspend(struct aiocb *);
 void readdata(struct aiocb *, off_t);
 void writedata(struct aiocb *, off_t);
 void syncdata(struct aiocb *);
+void makezipf(int, double);
+int searchzipf(double, int);
+int pickblock(int);
 void getindexes(int *, int);
-void cleanup(char **, int);
+void cleanup(char **, arena_t *, int);
 void reversebuffer(char *, int);
 void processblocks(struct aiocb *, char **, int, int, int);
+void runserial(int, int, int, int, arena_t *);
+void makeplan(struct plan *, int, int);
+int compareblockrefs(const void *, const void *);
+void transferruns(int, struct blockref *, int, char **, int, int, int);
+int planwindow(int);
+void planblocks(int, int, int, int, arena_t *);
+void reversecopy(char *, char *, int);
+void adviseblock(char *, int, int, int);
+void mapblocks(int, int, int, int, arena_t *, int);
+void writeback(int, struct blockcache *, int, int);
+int cacheslot(int, struct blockcache *, int, int, int);
+void cacheblocks(int, int, int, int, arena_t *, int);
+int owner(int, int, int);
+int comparemessages(const void *, const void *);
+void postmessage(struct inbox *, int, int, int, char *, int);
+void applymessages(struct worker *, struct inbox *);
+int picklocal(struct worker *, int);
+void *partitionworker(void *);
+void runpartitioned(int, int, int, int, arena_t *, int, unsigned int);
+void copyfile(char *, char *);
+void comparefiles(char *, char *);
 volatile sig_atomic_t work;
+/* cumulative Zipf distribution of block ranks, NULL - uniform selection */
+double *zipfcdf = NULL;
+prng_t rng;
 void error(char *msg){
 	perror(msg);
 	exit(EXIT_FAILURE);
 }
 void usage(char *progname){
-	fprintf(stderr, "%s workfile blocksize\n", progname);
+	fprintf(stderr, "%s [-d|-m] [-b] [-p] [-t] [-s seed] [-z theta] [-c blocks] [-w workers|-W max] workfile n k\n", progname);
+	fprintf(stderr, "-d - use O_DIRECT with aligned buffers, falls back to buffered I/O if refused\n");
+	fprintf(stderr, "-b - drop the file from page cache first, report throughput and page cache footprint\n");
+	fprintf(stderr, "-m - map the file and reverse the blocks in place instead of AIO, not with -d, with -p synced per window\n");
+	fprintf(stderr, "-p - precompute the schedule, reorder and coalesce the block accesses\n");
+	fprintf(stderr, "-t - run serial AIO on a copy of workfile with the same seed and compare the results\n");
+	fprintf(stderr, "-s - random seed, current time by default\n");
+	fprintf(stderr, "-z - draw blocks from a Zipf distribution with exponent theta > 0 (block 0 hottest) instead of uniformly\n");
+	fprintf(stderr, "-w - split the blocks between workers, each with its own AIO pipeline, with -t compared to a second run on a copy\n");
+	fprintf(stderr, "-W - run -w with 1, 2, 4, ... max workers and report the throughput of each, not with -t\n");
+	fprintf(stderr, "-c - run through a write-back cache of that many blocks instead of AIO, not with -m or -p\n");
 	fprintf(stderr, "workfile - path to the file to work on\n");
 	fprintf(stderr, "n - number of blocks\n");
 	fprintf(stderr, "k - number of iterations\n");
@@ -54,15 +169,73 @@ off_t getfilelength(int fd){
 		error("Cannot fstat file");
 	return buf.st_size;
 }
+/* O_DIRECT needs buffers, offsets and sizes aligned to the logical block size of the device */
+int getdirectalign(int fd){
+#ifdef STATX_DIOALIGN
+	struct statx stx;
+	if (statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0 && (stx.stx_mask & STATX_DIOALIGN) && stx.stx_dio_offset_align > 0)
+		return stx.stx_dio_offset_align > stx.stx_dio_mem_align ? stx.stx_dio_offset_align : stx.stx_dio_mem_align;
+#endif
+	struct stat buf;
+	if (fstat(fd, &buf) == -1)
+		error("Cannot fstat file");
+	return buf.st_blksize;
+}
+/* returns descriptor opened with O_DIRECT if filesystem accepts it, *direct is cleared otherwise */
+int opendirect(char *filename, int *direct){
+	int fd;
+	if (*direct){
+		if ((fd = TEMP_FAILURE_RETRY(open(filename, O_RDWR | O_DIRECT))) != -1)
+			return fd;
+		if (errno != EINVAL)
+			error("Cannot open file");
+		fprintf(stderr, "O_DIRECT refused, falling back to buffered I/O\n");
+		*direct = 0;
+	}
+	if ((fd = TEMP_FAILURE_RETRY(open(filename, O_RDWR))) == -1)
+		error("Cannot open file");
+	return fd;
+}
+/* buffers come from the arena reserved in main, released ones are reused by the next run */
+void allocbuffers(char **buffer, int count, arena_t *arena){
+	int i;
+	for (i = 0; i<count; i++)
+		if ((buffer[i] = arena_alloc(arena)) == NULL)
+			error("Cannot allocate memory");
+}
+/* number of file pages held in page cache, checked with mincore on a fresh mapping */
+long residentpages(int fd, long *total){
+	long i, count = 0, pagesize = sysconf(_SC_PAGESIZE);
+	off_t length = getfilelength(fd);
+	unsigned char *vec;
+	void *map;
+	*total = (length + pagesize - 1) / pagesize;
+	if (length == 0) return 0;
+	if ((map = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+		error("Cannot mmap file");
+	if ((vec = malloc(*total)) == NULL)
+		error("Cannot allocate memory");
+	if (mincore(map, length, vec) == -1)
+		error("Cannot run mincore");
+	for (i = 0; i < *total; i++)
+		count += vec[i] & 1;
+	free(vec);
+	if (munmap(map, length) == -1)
+		error("Cannot munmap file");
+	return count;
+}
 void suspend(struct aiocb *aiocbs){
 	struct aiocb *aiolist[1];
+	perfMark_t mark;
 	aiolist[0] = aiocbs;
 	if (!work) return;
+	perf_begin(&mark, "aio_suspend");
 	while (aio_suspend((const struct aiocb *const *) aiolist, 1, NULL) == -1){
 		if (!work) return;
 		if (errno == EINTR) continue;
 		error("Suspend error");
 	}
+	perf_end(&mark);
 	if (aio_error(aiocbs) != 0)
 		error("Suspend error");
 	if (aio_return(aiocbs) == -1)
@@ -97,36 +270,78 @@ void syncdata(struct aiocb *aiocbs){
 		error("Cannot sync\n");
 	suspend(aiocbs);
 }
+void makezipf(int max, double theta){
+	int i;
+	if ((zipfcdf = malloc(sizeof(double) * max)) == NULL)
+		error("Cannot allocate memory");
+	for (i = 0; i < max; i++)
+		zipfcdf[i] = (i ? zipfcdf[i - 1] : 0) + pow(i + 1, -theta);
+	for (i = 0; i < max; i++)
+		zipfcdf[i] /= zipfcdf[max - 1];
+}
+/* first block whose cumulative probability exceeds u */
+int searchzipf(double u, int max){
+	int low = 0, high = max - 1, mid;
+	while (low < high){
+		mid = (low + high) / 2;
+		if (zipfcdf[mid] > u) high = mid;
+		else low = mid + 1;
+	}
+	return low;
+}
+/* block number drawn from rng, uniform or from the Zipf distribution */
+int pickblock(int max){
+	if (zipfcdf == NULL) return prng_below(&rng, max);
+	return searchzipf(prng_double(&rng), max);
+}
+/* With Zipf the second block is drawn with the mass of the first removed: u is scaled to the
+ * remaining mass and moved past the first block's interval, one draw even if a large theta
+ * puts all the mass on block 0 */
 void getindexes(int *indexes, int max){
-	indexes[0] = rand() % max;
-	indexes[1] = rand() % (max - 1);
+	if (zipfcdf != NULL){
+		double lower, mass, u;
+		indexes[0] = pickblock(max);
+		lower = indexes[0] ? zipfcdf[indexes[0] - 1] : 0;
+		mass = zipfcdf[indexes[0]] - lower;
+		u = prng_double(&rng) * (1.0 - mass);
+		if (u >= lower) u += mass;
+		indexes[1] = searchzipf(u, max);
+		if (indexes[1] == indexes[0])
+			indexes[1] = indexes[0] + 1 < max ? indexes[0] + 1 : indexes[0] - 1;
+		return;
+	}
+	indexes[0] = prng_below(&rng, max);
+	indexes[1] = prng_below(&rng, max - 1);
 	if (indexes[1] >= indexes[0])
 		indexes[1]++;
 }
-void cleanup(char **buffers, int fd){
+void cleanup(char **buffers, arena_t *arena, int fd){
 	int i;
 	if (!work)
 		if (aio_cancel(fd, NULL) == -1)
 			error("Cannot cancel async. I/O operations");
 	for (i = 0; i<BLOCKS; i++)
-		free(buffers[i]);
+		arena_free(arena, buffers[i]);
 	if (TEMP_FAILURE_RETRY(fsync(fd)) == -1)
 		error("Error running fsync");
 }
 void reversebuffer(char *buffer, int blocksize){
 	int k;
 	char tmp;
+	perfMark_t mark;
+	perf_begin(&mark, "reversebuffer");
 	for (k = 0; work && k < blocksize / 2; k++){
 		tmp = buffer[k];
 		buffer[k] = buffer[blocksize - k - 1];
 		buffer[blocksize - k - 1] = tmp;
 	}
+	perf_end(&mark);
 }
 void processblocks(struct aiocb *aiocbs, char **buffer, int bcount, int bsize, int iterations){
 	int curpos, j, index[2];
 	iterations--;
 	curpos = iterations == 0 ? 1 : 0;
-	readdata(&aiocbs[1], bsize * (rand() % bcount));
+	readdata(&aiocbs[1], bsize * pickblock(bcount));
 	suspend(&aiocbs[1]);
 	for (j = 0; work && j<iterations; j++){
 		getindexes(index, bcount);
@@ -138,35 +353,603 @@ void processblocks(struct aiocb *aiocbs, char **buffer, int bcount, int bsize, i
 		curpos = SHIFT(curpos, 1);
 	}
 	if (iterations == 0) reversebuffer(buffer[curpos], bsize);
-	writedata(&aiocbs[curpos], bsize * (rand() % bcount));
+	writedata(&aiocbs[curpos], bsize * pickblock(bcount));
 	suspend(&aiocbs[curpos]);
 }
-int main(int argc, char *argv[]){
-	char *filename, *buffer[BLOCKS];
-	int fd, n, k, blocksize, i;
+void runserial(int fd, int bcount, int bsize, int iterations, arena_t *arena){
+	char *buffer[BLOCKS];
 	struct aiocb aiocbs[4];
-	if (argc != 4)
+	allocbuffers(buffer, BLOCKS, arena);
+	fillaiostructs(aiocbs, buffer, fd, bsize);
+	processblocks(aiocbs, buffer, bcount, bsize, iterations);
+	cleanup(buffer, arena, fd);
+}
+/* Replays the rng draws of processblocks. Transfer t reads block source[t], reverses it
+ * and writes it to target[t]. Serial order of accesses is R0, R1, W0, R2, W1, ..., W(count-1). */
+void makeplan(struct plan *p, int bcount, int iterations){
+	int j, index[2];
+	iterations--;
+	p->count = iterations > 1 ? iterations : 1;
+	if ((p->source = malloc(sizeof(int) * p->count)) == NULL || (p->target = malloc(sizeof(int) * p->count)) == NULL)
+		error("Cannot allocate memory");
+	p->source[0] = pickblock(bcount);
+	for (j = 0; j < iterations; j++){
+		getindexes(index, bcount);
+		if (j > 0) p->target[j - 1] = index[0];
+		if (j < iterations - 1) p->source[j + 1] = index[1];
+	}
+	p->target[p->count - 1] = pickblock(bcount);
+}
+int compareblockrefs(const void *a, const void *b){
+	return ((const struct blockref *) a)->block - ((const struct blockref *) b)->block;
+}
+/* Sorts the accesses by offset and merges neighbouring blocks into one preadv/pwritev */
+void transferruns(int fd, struct blockref *refs, int count, char **slots, int nslots, int bsize, int write){
+	struct iovec iov[IOV_MAX];
+	int i, j;
+	ssize_t done;
+	perfMark_t mark;
+	perf_begin(&mark, write ? "write_runs" : "read_runs");
+	qsort(refs, count, sizeof(struct blockref), compareblockrefs);
+	for (i = 0; i < count; i = j){
+		for (j = i; j < count && j - i < IOV_MAX && refs[j].block == refs[i].block + (j - i); j++){
+			iov[j - i].iov_base = slots[refs[j].transfer % nslots];
+			iov[j - i].iov_len = bsize;
+		}
+		if (write) done = TEMP_FAILURE_RETRY(pwritev(fd, iov, j - i, (off_t) refs[i].block * bsize));
+		else done = TEMP_FAILURE_RETRY(preadv(fd, iov, j - i, (off_t) refs[i].block * bsize));
+		if (done != (ssize_t) (j - i) * bsize)
+			error(write ? "Cannot write" : "Cannot read");
+	}
+	perf_end(&mark);
+}
+/* Executes the schedule in windows of transfers. Within a window reads of blocks written earlier
+ * in the same window are forwarded from memory, the remaining reads are issued together before
+ * and only the last write of every block is issued after the window, both in offset order.
+ * Transfer t lives in slot t % nslots from its read to its write (one window later at most). */
+int planwindow(int bsize){
+	int window = PLAN_MEMORY / bsize;
+	if (window > PLAN_WINDOW) window = PLAN_WINDOW;
+	if (window < 1) window = 1;
+	return window;
+}
+void planblocks(int fd, int bcount, int bsize, int iterations, arena_t *arena){
+	struct plan p;
+	struct blockstate *state;
+	struct blockref *refs;
+	int *from, nslots, window, w, a, b, t, u, i, count;
+	char **slots;
+	makeplan(&p, bcount, iterations);
+	window = planwindow(bsize);
+	nslots = window + 1;
+	if ((slots = malloc(sizeof(char *) * nslots)) == NULL || (from = malloc(sizeof(int) * window)) == NULL
+		|| (refs = malloc(sizeof(struct blockref) * nslots)) == NULL || (state = malloc(sizeof(struct blockstate) * bcount)) == NULL)
+		error("Cannot allocate memory");
+	allocbuffers(slots, nslots, arena);
+	for (i = 0; i < bcount; i++)
+		state[i].window = -1;
+	for (w = 0, a = 0; work && a < p.count; w++, a = b){
+		b = a + window < p.count ? a + window : p.count;
+		/* pairs R(t), W(t-1) for t in [a,b), the final W(count-1) closes the last window */
+		for (t = a; t <= b; t++){
+			if (t < b){
+				struct blockstate *s = &state[p.source[t]];
+				if (s->window != w){
+					s->window = w;
+					s->writer = s->reader = -1;
+				}
+				if (s->writer >= 0) from[t - a] = s->writer;
+				else if (s->reader >= 0) from[t - a] = -2 - s->reader;
+				else from[t - a] = -1, s->reader = t;
+			}
+			u = t - 1;
+			if (u >= 0 && (t < b || b == p.count)){
+				struct blockstate *s = &state[p.target[u]];
+				if (s->window != w){
+					s->window = w;
+					s->writer = s->reader = -1;
+				}
+				s->writer = u;
+			}
+		}
+		for (count = 0, t = a; t < b; t++)
+			if (from[t - a] == -1){
+				refs[count].block = p.source[t];
+				refs[count++].transfer = t;
+			}
+		transferruns(fd, refs, count, slots, nslots, bsize, 0);
+		for (t = a; t < b; t++){
+			if (from[t - a] >= 0){
+				memcpy(slots[t % nslots], slots[from[t - a] % nslots], bsize);
+				reversebuffer(slots[t % nslots], bsize);
+			}
+			else if (from[t - a] < -1)
+				memcpy(slots[t % nslots], slots[(-2 - from[t - a]) % nslots], bsize);
+			else reversebuffer(slots[t % nslots], bsize);
+		}
+		if (!work) break;
+		for (count = 0, u = a > 0 ? a - 1 : 0; u < (b == p.count ? b : b - 1); u++)
+			if (state[p.target[u]].writer == u){
+				refs[count].block = p.target[u];
+				refs[count++].transfer = u;
+			}
+		transferruns(fd, refs, count, slots, nslots, bsize, 1);
+		if (TEMP_FAILURE_RETRY(fdatasync(fd)) == -1)
+			error("Error running fdatasync");
+	}
+	for (i = 0; i < nslots; i++)
+		arena_free(arena, slots[i]);
+	free(slots);
+	free(from);
+	free(refs);
+	free(state);
+	free(p.source);
+	free(p.target);
+	if (TEMP_FAILURE_RETRY(fsync(fd)) == -1)
+		error("Error running fsync");
+}
+void reversecopy(char *dst, char *src, int blocksize){
+	int k;
+	perfMark_t mark;
+	if (!work) return;
+	perf_begin(&mark, "reversecopy");
+	for (k = 0; k < blocksize; k++)
+		dst[k] = src[blocksize - k - 1];
+	perf_end(&mark);
+}
+/* madvise and msync need page aligned ranges, the block is widened to whole pages */
+void adviseblock(char *map, int block, int bsize, int advice){
+	long pagesize = sysconf(_SC_PAGESIZE);
+	off_t start = (off_t) block * bsize, end = start + bsize;
+	start -= start % pagesize;
+	if (advice == MS_SYNC){
+		if (msync(map + start, end - start, MS_SYNC) == -1)
+			error("Cannot sync");
+	}
+	else if (madvise(map + start, end - start, advice) == -1)
+		error("Cannot advise");
+}
+/* Runs the schedule of makeplan on a shared mapping of the file. The read of transfer t+1 comes
+ * before the write of t in the serial order, it only has to be copied aside when the write of t
+ * overwrites it, otherwise the block is still intact when transfer t+1 reverses it straight from
+ * the mapping (in place if source and target are the same block). Every write is synced with
+ * msync like aio_fsync in processblocks, or with windowed set once per planner window like
+ * planblocks. Blocks MAP_PREFETCH transfers ahead are prefetched. */
+void mapblocks(int fd, int bcount, int bsize, int iterations, arena_t *arena, int windowed){
+	struct plan p;
+	char *map, *saved[2], *src, *dst;
+	off_t length = getfilelength(fd);
+	int t, u, cursaved = 0, nextsaved, window = planwindow(bsize);
+	makeplan(&p, bcount, iterations);
+	if ((map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+		error("Cannot map file");
+	allocbuffers(saved, 2, arena);
+	for (u = 0; u < MAP_PREFETCH && u < p.count; u++){
+		adviseblock(map, p.source[u], bsize, MADV_WILLNEED);
+		adviseblock(map, p.target[u], bsize, MADV_WILLNEED);
+	}
+	for (t = 0; work && t < p.count; t++){
+		if ((u = t + MAP_PREFETCH) < p.count){
+			adviseblock(map, p.source[u], bsize, MADV_WILLNEED);
+			adviseblock(map, p.target[u], bsize, MADV_WILLNEED);
+		}
+		dst = map + (off_t) p.target[t] * bsize;
+		nextsaved = t + 1 < p.count && p.source[t + 1] == p.target[t];
+		if (nextsaved)
+			memcpy(saved[(t + 1) % 2], dst, bsize);
+		src = cursaved ? saved[t % 2] : map + (off_t) p.source[t] * bsize;
+		if (src == dst) reversebuffer(dst, bsize);
+		else reversecopy(dst, src, bsize);
+		if (!windowed) adviseblock(map, p.target[t], bsize, MS_SYNC);
+		else if ((t + 1) % window == 0 && TEMP_FAILURE_RETRY(fdatasync(fd)) == -1)
+			error("Error running fdatasync");
+		cursaved = nextsaved;
+	}
+	for (u = 0; u < 2; u++)
+		arena_free(arena, saved[u]);
+	if (munmap(map, length) == -1)
+		error("Cannot unmap file");
+	free(p.source);
+	free(p.target);
+	if (TEMP_FAILURE_RETRY(fsync(fd)) == -1)
+		error("Error running fsync");
+}
+/* Writes back the dirty run of cached blocks around block b with one pwritev */
+void writeback(int fd, struct blockcache *c, int b, int bcount){
+	struct iovec iov[IOV_MAX];
+	int first = b, last = b, i;
+	while (first > 0 && last - first + 1 < IOV_MAX && c->slot[first - 1] >= 0 && c->dirty[c->slot[first - 1]])
+		first--;
+	while (last < bcount - 1 && last - first + 1 < IOV_MAX && c->slot[last + 1] >= 0 && c->dirty[c->slot[last + 1]])
+		last++;
+	for (i = first; i <= last; i++){
+		iov[i - first].iov_base = c->data[c->slot[i]];
+		iov[i - first].iov_len = c->blocksize;
+		c->dirty[c->slot[i]] = 0;
+	}
+	if (TEMP_FAILURE_RETRY(pwritev(fd, iov, last - first + 1, (off_t) first * c->blocksize)) != (ssize_t) (last - first + 1) * c->blocksize)
+		error("Cannot write");
+	c->writes++;
+}
+/* Returns the slot of block b, on a miss a slot is taken (CLOCK eviction, dirty victims are
+ * written back first) and filled from the file unless the caller overwrites the whole block */
+int cacheslot(int fd, struct blockcache *c, int b, int bcount, int fill){
+	int s = c->slot[b];
+	if (s >= 0){
+		c->hits++;
+		c->referenced[s] = 1;
+		return s;
+	}
+	c->misses++;
+	if (c->used < c->capacity) s = c->used++;
+	else {
+		while (c->referenced[c->hand]){
+			c->referenced[c->hand] = 0;
+			c->hand = (c->hand + 1) % c->capacity;
+		}
+		s = c->hand;
+		c->hand = (c->hand + 1) % c->capacity;
+		if (c->dirty[s]) writeback(fd, c, c->block[s], bcount);
+		c->slot[c->block[s]] = -1;
+	}
+	c->block[s] = b;
+	c->slot[b] = s;
+	c->dirty[s] = 0;
+	c->referenced[s] = 1;
+	if (fill){
+		if (TEMP_FAILURE_RETRY(pread(fd, c->data[s], c->blocksize, (off_t) b * c->blocksize)) != c->blocksize)
+			error("Cannot read");
+		c->reads++;
+	}
+	return s;
+}
+/* Runs the schedule of makeplan through a CLOCK cache of capacity blocks. Reads that hit skip
+ * the disk, writes only dirty the cached block (a full block write needs no read), repeated
+ * writes of one block collapse into one and dirty neighbours are written back together.
+ * The read of transfer t+1 is taken before the write of t as in the serial order. Dirty blocks
+ * reach the disk on eviction and at the end, followed by one fsync. */
+void cacheblocks(int fd, int bcount, int bsize, int iterations, arena_t *arena, int capacity){
+	struct plan p;
+	struct blockcache c;
+	char *buffer[2];
+	int t, i, s;
+	memset(&c, 0, sizeof(c));
+	c.capacity = capacity;
+	c.blocksize = bsize;
+	makeplan(&p, bcount, iterations);
+	if ((c.block = malloc(sizeof(int) * capacity)) == NULL || (c.slot = malloc(sizeof(int) * bcount)) == NULL
+		|| (c.dirty = calloc(capacity, 1)) == NULL || (c.referenced = calloc(capacity, 1)) == NULL
+		|| (c.data = malloc(sizeof(char *) * capacity)) == NULL)
+		error("Cannot allocate memory");
+	for (i = 0; i < bcount; i++)
+		c.slot[i] = -1;
+	allocbuffers(c.data, capacity, arena);
+	allocbuffers(buffer, 2, arena);
+	memcpy(buffer[0], c.data[cacheslot(fd, &c, p.source[0], bcount, 1)], bsize);
+	for (t = 0; work && t < p.count; t++){
+		if (t + 1 < p.count)
+			memcpy(buffer[(t + 1) % 2], c.data[cacheslot(fd, &c, p.source[t + 1], bcount, 1)], bsize);
+		reversebuffer(buffer[t % 2], bsize);
+		s = cacheslot(fd, &c, p.target[t], bcount, 0);
+		memcpy(c.data[s], buffer[t % 2], bsize);
+		c.dirty[s] = 1;
+	}
+	for (i = 0; i < bcount; i++)
+		if (c.slot[i] >= 0 && c.dirty[c.slot[i]])
+			writeback(fd, &c, i, bcount);
+	if (TEMP_FAILURE_RETRY(fsync(fd)) == -1)
+		error("Error running fsync");
+	fprintf(stderr, "cache: %d blocks, hit rate %.1f%% (%ld hits, %ld misses), %ld reads and %ld writes instead of %d, %.1f%% of I/O saved\n",
+		capacity, 100.0 * c.hits / (c.hits + c.misses), c.hits, c.misses, c.reads, c.writes, 2 * p.count,
+		100.0 * (2 * p.count - c.reads - c.writes) / (2 * p.count));
+	for (i = 0; i < 2; i++)
+		arena_free(arena, buffer[i]);
+	for (i = 0; i < capacity; i++)
+		arena_free(arena, c.data[i]);
+	free(c.block);
+	free(c.slot);
+	free(c.dirty);
+	free(c.referenced);
+	free(c.data);
+	free(p.source);
+	free(p.target);
+}
+/* worker w owns blocks [w * bcount / workers, (w + 1) * bcount / workers) */
+int owner(int block, int bcount, int workers){
+	int w = (int) ((long) block * workers / bcount);
+	while ((long) (w + 1) * bcount / workers <= block) w++;
+	while ((long) w * bcount / workers > block) w--;
+	return w;
+}
+int comparemessages(const void *a, const void *b){
+	const struct message *x = a, *y = b;
+	if (x->sender != y->sender) return x->sender - y->sender;
+	return x->seq - y->seq;
+}
+void postmessage(struct inbox *box, int block, int sender, int seq, char *buffer, int bsize){
+	struct message m = { block, sender, seq, malloc(bsize) };
+	if (m.data == NULL)
+		error("Cannot allocate memory");
+	memcpy(m.data, buffer, bsize);
+	pthread_mutex_lock(&box->mutex);
+	if (box->count == box->size){
+		box->size = box->size ? 2 * box->size : 64;
+		if ((box->messages = realloc(box->messages, sizeof(struct message) * box->size)) == NULL)
+			error("Cannot allocate memory");
+	}
+	box->messages[box->count++] = m;
+	pthread_mutex_unlock(&box->mutex);
+}
+/* Messages of the previous round are written in sender and sequence order, which does not
+ * depend on thread timing, so the file content only depends on the seed and worker count */
+void applymessages(struct worker *w, struct inbox *box){
+	int i;
+	qsort(box->messages, box->count, sizeof(struct message), comparemessages);
+	for (i = 0; i < box->count; i++){
+		if (TEMP_FAILURE_RETRY(pwrite(w->fd, box->messages[i].data, w->bsize, (off_t) box->messages[i].block * w->bsize)) != w->bsize)
+			error("Cannot write");
+		free(box->messages[i].data);
+	}
+	box->count = 0;
+}
+/* Local block of the worker, different from avoid (a write still in flight) */
+int picklocal(struct worker *w, int avoid){
+	int b, size = w->last - w->first;
+	b = w->first + prng_below(&w->rng, size - (avoid >= w->first && avoid < w->last));
+	if (avoid >= w->first && avoid < w->last && b >= avoid) b++;
+	return b;
+}
+/* Own AIO pipeline of a worker: the read of the next source block and the write of the current
+ * target overlap the reversal. Sources are always local, a target owned by another worker is
+ * posted to its inbox for the next round. Worker 0 syncs the file after every round.
+ * Worker 0 alone reads work before the barrier and publishes the decision in stop (one slot per
+ * round parity), so all workers leave after the same barrier even if SIGINT comes in between. */
+void *partitionworker(void *arg){
+	struct worker *w = arg;
+	struct aiocb aiocbs[BLOCKS], *target;
+	int r, i, count, done = 0, source, dest, seq = 0;
+	fillaiostructs(aiocbs, w->buffer, w->fd, w->bsize);
+	for (r = 0; r < w->rounds; ){
+		applymessages(w, &w->inboxes[(r % 2) * w->workers + w->id]);
+		count = w->iterations - done < PART_ROUND ? w->iterations - done : PART_ROUND;
+		if (count > 0){
+			source = picklocal(w, -1);
+			readdata(&aiocbs[0], (off_t) source * w->bsize);
+			suspend(&aiocbs[0]);
+		}
+		for (i = 0; work && i < count; i++){
+			dest = prng_below(&w->rng, w->bcount);
+			if (i + 1 < count){
+				source = picklocal(w, dest);
+				readdata(&aiocbs[(i + 1) % 2], (off_t) source * w->bsize);
+			}
+			reversebuffer(w->buffer[i % 2], w->bsize);
+			target = NULL;
+			if (owner(dest, w->bcount, w->workers) == w->id){
+				target = &aiocbs[i % 2];
+				writedata(target, (off_t) dest * w->bsize);
+			}
+			else {
+				postmessage(&w->inboxes[((r + 1) % 2) * w->workers + owner(dest, w->bcount, w->workers)], dest, w->id, seq++, w->buffer[i % 2], w->bsize);
+				w->sent++;
+			}
+			if (i + 1 < count) suspend(&aiocbs[(i + 1) % 2]);
+			if (target) suspend(target);
+		}
+		done += count;
+		if (w->id == 0) w->stop[r % 2] = !work;
+		pthread_barrier_wait(w->barrier);
+		if (w->id == 0 && TEMP_FAILURE_RETRY(fdatasync(w->fd)) == -1)
+			error("Error running fdatasync");
+		if (w->stop[r++ % 2]) break;
+	}
+	applymessages(w, &w->inboxes[(r % 2) * w->workers + w->id]);
+	return NULL;
+}
+/* Splits the blocks into one range per worker and k transfers between the workers, every worker
+ * draws from its own stream split from the seed */
+void runpartitioned(int fd, int bcount, int bsize, int iterations, arena_t *arena, int workers, unsigned int seed){
+	struct worker *w;
+	struct inbox *inboxes;
+	pthread_barrier_t barrier;
+	prng_t master;
+	int i, j, rounds, stop[2] = { 0, 0 };
+	long sent = 0;
+	if ((w = calloc(workers, sizeof(struct worker))) == NULL || (inboxes = calloc(2 * workers, sizeof(struct inbox))) == NULL)
+		error("Cannot allocate memory");
+	for (i = 0; i < 2 * workers; i++)
+		if (pthread_mutex_init(&inboxes[i].mutex, NULL))
+			error("Cannot initialize mutex");
+	if (pthread_barrier_init(&barrier, NULL, workers))
+		error("Cannot initialize barrier");
+	prng_seed(&master, seed);
+	rounds = (iterations / workers + (iterations % workers ? 1 : 0) + PART_ROUND - 1) / PART_ROUND;
+	for (i = 0; i < workers; i++){
+		w[i].id = i;
+		w[i].workers = workers;
+		w[i].fd = fd;
+		w[i].bcount = bcount;
+		w[i].bsize = bsize;
+		w[i].first = (long) i * bcount / workers;
+		w[i].last = (long) (i + 1) * bcount / workers;
+		w[i].iterations = iterations / workers + (i < iterations % workers ? 1 : 0);
+		w[i].rounds = rounds;
+		prng_split(&master, &w[i].rng);
+		w[i].inboxes = inboxes;
+		w[i].barrier = &barrier;
+		w[i].stop = stop;
+		allocbuffers(w[i].buffer, BLOCKS, arena);
+	}
+	for (i = 0; i < workers; i++)
+		if (pthread_create(&w[i].tid, NULL, partitionworker, &w[i]))
+			error("Cannot create worker");
+	for (i = 0; i < workers; i++){
+		if (pthread_join(w[i].tid, NULL))
+			error("Cannot join worker");
+		sent += w[i].sent;
+		for (j = 0; j < BLOCKS; j++)
+			arena_free(arena, w[i].buffer[j]);
+	}
+	for (i = 0; i < 2 * workers; i++){
+		pthread_mutex_destroy(&inboxes[i].mutex);
+		free(inboxes[i].messages);
+	}
+	pthread_barrier_destroy(&barrier);
+	free(inboxes);
+	free(w);
+	if (TEMP_FAILURE_RETRY(fsync(fd)) == -1)
+		error("Error running fsync");
+	fprintf(stderr, "%d workers, %d rounds, %ld of %d blocks sent to other partitions\n", workers, rounds, sent, iterations);
+}
+void copyfile(char *from, char *to){
+	int in, out;
+	ssize_t count;
+	if ((in = TEMP_FAILURE_RETRY(open(from, O_RDONLY))) == -1)
+		error("Cannot open file");
+	if ((out = TEMP_FAILURE_RETRY(open(to, O_WRONLY | O_CREAT | O_TRUNC, 0600))) == -1)
+		error("Cannot create copy");
+	while ((count = copy_file_range(in, NULL, out, NULL, 1 << 30, 0)) > 0);
+	if (count == -1)
+		error("Cannot copy file");
+	if (TEMP_FAILURE_RETRY(close(in)) == -1 || TEMP_FAILURE_RETRY(close(out)) == -1)
+		error("Cannot close file");
+}
+void comparefiles(char *first, char *second){
+	char a[65536], b[65536];
+	int fa, fb;
+	ssize_t ca, cb, i;
+	off_t offset = 0;
+	if ((fa = TEMP_FAILURE_RETRY(open(first, O_RDONLY))) == -1 || (fb = TEMP_FAILURE_RETRY(open(second, O_RDONLY))) == -1)
+		error("Cannot open file");
+	do {
+		if ((ca = TEMP_FAILURE_RETRY(read(fa, a, sizeof(a)))) == -1 || (cb = TEMP_FAILURE_RETRY(read(fb, b, sizeof(b)))) == -1)
+			error("Cannot read");
+		for (i = 0; i < ca && i < cb && a[i] == b[i]; i++);
+		if (i < ca || i < cb){
+			fprintf(stderr, "MISMATCH at offset %ld\n", (long) (offset + i));
+			exit(EXIT_FAILURE);
+		}
+		offset += ca;
+	} while (ca > 0);
+	fprintf(stderr, "OK: %s and %s are identical (%ld bytes)\n", first, second, (long) offset);
+	if (TEMP_FAILURE_RETRY(close(fa)) == -1 || TEMP_FAILURE_RETRY(close(fb)) == -1)
+		error("Cannot close file");
+}
+int main(int argc, char *argv[]){
+	char *filename, copyname[PATH_MAX];
+	int fd, copy, n, k, blocksize, c, align = 0, direct = 0, bench = 0, plan = 0, test = 0, mapped = 0, cache = 0, slots, workers = 0, maxworkers = 0;
+	double theta = 0;
+	unsigned int seed = time(NULL);
+	struct timespec start, end;
+	long resident, total;
+	double elapsed;
+	arena_t arena;
+	while ((c = getopt(argc, argv, "dbmpts:z:c:w:W:")) != -1)
+		switch (c){
+			case 'd': direct = 1; break;
+			case 'm': mapped = 1; break;
+			case 'b': bench = 1; break;
+			case 'p': plan = 1; break;
+			case 't': test = 1; break;
+			case 's': seed = strtoul(optarg, NULL, 10); break;
+			case 'z': if ((theta = atof(optarg)) <= 0) usage(argv[0]); break;
+			case 'c': if ((cache = atoi(optarg)) <= 0) usage(argv[0]); break;
+			case 'w': if ((workers = atoi(optarg)) <= 0) usage(argv[0]); break;
+			case 'W': if ((maxworkers = atoi(optarg)) <= 0) usage(argv[0]); break;
+			default: usage(argv[0]);
+		}
+	if (argc - optind != 3 || (mapped && direct) || (cache && (mapped || plan))
+		|| ((workers || maxworkers) && (direct || mapped || plan || cache || theta > 0 || (workers && maxworkers) || (test && maxworkers))))
 		usage(argv[0]);
-	filename = argv[1];
-	n = atoi(argv[2]);
-	k = atoi(argv[3]);
+	filename = argv[optind];
+	n = atoi(argv[optind + 1]);
+	k = atoi(argv[optind + 2]);
 	if (n < 2 || k < 1)
 		return EXIT_SUCCESS;
+	if (n < 2 * (workers > maxworkers ? workers : maxworkers)){
+		fprintf(stderr, "Every worker needs at least 2 blocks\n");
+		return EXIT_FAILURE;
+	}
+	if (theta > 0)
+		makezipf(n, theta);
 	work = 1;
+	perf_init();
 	sethandler(siginthandler, SIGINT);
-	if ((fd = TEMP_FAILURE_RETRY(open(filename, O_RDWR))) == -1)
-		error("Cannot open file");
+	fd = opendirect(filename, &direct);
 	blocksize = (getfilelength(fd) - 1) / n;
-	fprintf(stderr, "Blocksize: %d\n", blocksize);
+	if (direct){
+		align = getdirectalign(fd);
+		blocksize -= blocksize % align;
+		if (blocksize == 0){
+			fprintf(stderr, "Blocks smaller than %d bytes, falling back to buffered I/O\n", align);
+			if (TEMP_FAILURE_RETRY(close(fd)) == -1)
+				error("Cannot close file");
+			fd = opendirect(filename, &direct);
+			blocksize = (getfilelength(fd) - 1) / n;
+			align = 0;
+		}
+	}
+	fprintf(stderr, "Blocksize: %d%s\n", blocksize, direct ? " (O_DIRECT)" : "");
 	if (blocksize > 0)
 	{
-		for (i = 0; i<BLOCKS; i++)
-			if ((buffer[i] = (char *) calloc (blocksize, sizeof(char))) == NULL)
-				error("Cannot allocate memory");
-		fillaiostructs(aiocbs, buffer, fd, blocksize);
-		srand(time(NULL));
-		processblocks(aiocbs, buffer, n, blocksize, k);
-		cleanup(buffer, fd);
+		slots = BLOCKS;
+		if (plan && !mapped && planwindow(blocksize) + 1 > slots) slots = planwindow(blocksize) + 1;
+		if (cache && cache + 2 > slots) slots = cache + 2;
+		if (BLOCKS * workers > slots) slots = BLOCKS * workers;
+		if (BLOCKS * maxworkers > slots) slots = BLOCKS * maxworkers;
+		if (arena_init(&arena, blocksize, slots, align, ARENA_POPULATE))
+			error("Cannot allocate memory");
+		if (bench && posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED))
+			error("Cannot drop page cache");
+		if (test){
+			snprintf(copyname, sizeof(copyname), "%s.serial", filename);
+			copyfile(filename, copyname);
+			if ((copy = TEMP_FAILURE_RETRY(open(copyname, O_RDWR))) == -1)
+				error("Cannot open file");
+			prng_seed(&rng, seed);
+			if (clock_gettime(CLOCK_MONOTONIC, &start)) error("Cannot get time");
+			if (workers) runpartitioned(copy, n, blocksize, k, &arena, workers, seed);
+			else runserial(copy, n, blocksize, k, &arena);
+			if (clock_gettime(CLOCK_MONOTONIC, &end)) error("Cannot get time");
+			if (bench)
+				fprintf(stderr, "%s reference: %.3f s\n", workers ? "partitioned" : "serial AIO", (ELAPSED(start, end)));
+			if (TEMP_FAILURE_RETRY(close(copy)) == -1)
+				error("Cannot close file");
+		}
+		for (c = 1; c <= maxworkers; c *= 2){
+			if (posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED))
+				error("Cannot drop page cache");
+			if (clock_gettime(CLOCK_MONOTONIC, &start)) error("Cannot get time");
+			runpartitioned(fd, n, blocksize, k, &arena, c, seed);
+			if (clock_gettime(CLOCK_MONOTONIC, &end)) error("Cannot get time");
+			elapsed = ELAPSED(start, end);
+			fprintf(stderr, "%2d workers: %.3f s, %.2f MB/s\n", c, elapsed, 2.0 * k * blocksize / elapsed / (1024 * 1024));
+		}
+		if (!maxworkers){
+			prng_seed(&rng, seed);
+			if (clock_gettime(CLOCK_MONOTONIC, &start)) error("Cannot get time");
+			if (workers) runpartitioned(fd, n, blocksize, k, &arena, workers, seed);
+			else if (cache) cacheblocks(fd, n, blocksize, k, &arena, cache);
+			else if (mapped) mapblocks(fd, n, blocksize, k, &arena, plan);
+			else if (plan) planblocks(fd, n, blocksize, k, &arena);
+			else runserial(fd, n, blocksize, k, &arena);
+			if (clock_gettime(CLOCK_MONOTONIC, &end)) error("Cannot get time");
+		}
+		if (test){
+			comparefiles(filename, copyname);
+			if (unlink(copyname) == -1)
+				error("Cannot remove copy");
+		}
+		if (bench && !maxworkers){
+			elapsed = ELAPSED(start, end);
+			resident = residentpages(fd, &total);
+			fprintf(stderr, "%s: %.3f s, %.2f MB/s, page cache: %ld of %ld pages resident\n",
+				workers ? "partitioned" : cache ? "cached" : mapped ? (plan ? "mmap, synced per window" : "mmap") : plan ? (direct ? "planned, O_DIRECT" : "planned") : (direct ? "O_DIRECT" : "buffered"), elapsed,
+				2.0 * k * blocksize / elapsed / (1024 * 1024), resident, total);
+			arena_stats(&arena, stderr);
+		}
+		arena_destroy(&arena);
+		free(zipfcdf);
 	}
 	if (TEMP_FAILURE_RETRY(close(fd)) == -1)
 		error("Cannot close file");
@@ -174,7 +957,7 @@ int main(int argc, char *argv[]){
 }
 /*
 Inclrease of BLOCKS value will not improve the algorithm, it will use only 3 blocks at a time and the rest will be just a waste of memory. Decrease of this value below 3 will turn the program useless.
-Algorithms based on random decisions are easier to test if you fix the random seed. Instead of srand(time(NULL)) use srand(1) for testing. It will result in rand generating the same sequences of numbers every time you run the program.
+Algorithms based on random decisions are easier to test if you fix the random seed. Instead of seeding with time use a fixed seed for testing (-s 1). The generator (xoshiro256** from ../prng.h) will then give the same sequences of numbers every time you run the program.
 Block size calculation is based on the file size decreased by one "blocksize = (getfilelength(fd) - 1) / n;". This decrease is a caused by the rule that UNIX text file should always end with new line character. As we do not want to move this last character in the file (\n) we must decrease the size by one. If you wish to use binary files (without last \n) remove - 1 from the calculation.
 Call to function aio_fsync requires separate synchronization as regular aio_read and aio_write operations thus double suspend call in function syncdata - first suspend is for write operation, the second for disk synchronization.
 Start with the analysis how the code runs for one iteration (k=1) and then for multiple iterations (k>0).
@@ -204,3 +987,12 @@ Ad.It is initiated in cleanup function provide the process received the SIGINT s
 Correct the code for exercise.
 Convert all AIO operations to synchronous IO (change all aio_ calls to synchronous IO calls and get rid of aio_suspend). Do some testing for small blocks (10B) and large blocks (2MB). To create large random file you can run this "$dd bs=1024 count=200000 if=/dev/urandom of=testBin.txt". When AIO is faster, can it be slower that regular IO? To measure time you can use time command ($ man time).
 Ad.In my tests small blocks were processed in comparable times, this proves the Linux implementation of AIO to be quite fast, I expected it to be slower. Processing of large blocks was more than two times faster with AIO. I tested for 100 iterations.
+O_DIRECT mode (-d) bypasses the page cache, transfers go straight between the aligned buffers and the device. Block size is rounded down to the logical block size, on filesystems that refuse O_DIRECT (e.g. tmpfs) the program falls back to buffered I/O. Compare "-b" runs with and without "-d" to see the difference in throughput and in page cache footprint.
+Planner mode (-p) replays the rng draws of processblocks first and gets the whole list of transfers (read block, reverse, write block). Transfers are executed in windows, a read of a block that was written earlier in the same window is served from memory, other reads of the window are issued in offset order and neighbours are merged into one preadv, then only the last write of each block goes to disk with pwritev in offset order.
+How do we know the planner gives the same file as the AIO loop?
+Ad.Run it with "-t -s seed", the serial AIO version runs on a copy of the file with the same seed and both files are compared byte by byte.
+All block buffers (3 for the serial run, window + 1 slots for the planner) are reserved once in main from the arena (../arena.h), on huge pages when available and faulted in before the timed part. The -t reference run and the measured run reuse the same buffers, -b prints the arena page faults (ARENA_NOHUGE=1 for comparison).
+-m replaces AIO with a shared mapping of the file (mapblocks), blocks are reversed straight in the page cache without the two copies through private buffers. With -p the writes are synced once per planner window instead of after every block. Use -m -t -b to check it against serial AIO on the same seed and to get both times, repeat for different n (block size) and file sizes to see where each backend wins.
+-z theta skews the block selection towards low block numbers (Zipf), -c blocks runs the schedule through a write-back CLOCK cache (cacheblocks): hits skip the read, writes stay in memory until eviction or the end, dirty neighbours are written back with one pwritev. Its durability is weaker than serial AIO, the file is only synced at the end. Use -z 1.2 -c 64 -t -b to see the hit rate and the saved I/O against the uncached result.
+-w workers splits the blocks into one contiguous range per worker thread (runpartitioned), every worker reads only its own blocks through its own AIO pipeline and draws its transfers from its own stream split from the seed (../prng.h). A reversed block whose target belongs to another worker is posted to that worker's inbox and written by the owner at the start of the next round of PART_ROUND transfers, in sender and sequence order, so the result is the same for the same seed and worker count regardless of the thread timing (check with -w N -t). It is a different schedule than the serial one. The file is synced once per round instead of after every write. -W max measures the scaling with 1, 2, 4, ... max workers.
+*/
\ No newline at end of file
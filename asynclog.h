@@ -0,0 +1,334 @@
+#ifndef ASYNCLOG_H
+#define ASYNCLOG_H
+/*
+Asynchronous log for the printing hot paths (14.c, 15.c, 16.c), alog can be called from threads and from signal handlers.
+alog formats the record into a fixed size slot of a ring owned by the calling thread (a thread takes a ring on its first call, handlers use the ring of the thread they interrupted). A slot is reserved with compare and swap on the ring head and published with a sequence number, no locks and no stdio, so a handler interrupting alog in the same thread only takes the next slot. When the ring is full the record is dropped and counted, the caller never waits.
+A background thread (all signals blocked, so the signals keep going to the program threads) collects the published records every ALOG_INTERVAL_MS and writes them to the fd given to alog_init in writes of up to ALOG_BATCH bytes. alog_flush does the same at once, call it before printing with stdio to the same fd. At exit the writer is stopped and the rest is written, records from the last interval are lost if the process is killed.
+The formatter is a small async-signal-safe subset of printf: %d %i %u %x %c %s %% with l, ll and z sizes, flags 0 and -, width, and %f with precision. Records longer than ALOG_RECORD bytes are cut.
+ALOG_RATE environment variable limits the output to that many records per second (bursts up to one second worth), the rest is dropped and counted. ALOG_SYNC writes every record at once with one write call, to compare the cost of synchronous logging.
+fork: a child discards the records inherited from the parent, it must call alog_child right after fork returns 0 to get its own writer (the atfork handler can not start a thread), until then its records wait in the rings for exit.
+Usage:
+	alog_init(STDOUT_FILENO);
+	if (fork() == 0) alog_child();
+	alog("[%d] received signal %d\n", getpid(), sig);
+	alog_flush();
+*/
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define ALOG_RINGS 32
+#define ALOG_SLOTS 512
+#define ALOG_RECORD 120
+#define ALOG_BATCH (64*1024)
+#define ALOG_INTERVAL_MS 10
+
+typedef struct alogSlot {
+	unsigned long seq;
+	int len;
+	char text[ALOG_RECORD];
+} alogSlot_t;
+
+typedef struct alogRing {
+	unsigned long head;
+	char pad[64 - sizeof(unsigned long)];
+	unsigned long tail;
+	alogSlot_t slots[ALOG_SLOTS];
+} alogRing_t;
+
+static alogRing_t alogRings[ALOG_RINGS];
+static int alogRingsUsed;
+static __thread int alogRing = -1;
+static int alogFd = -1;
+static int alogSync;
+static double alogRate;
+static double alogTokens;
+static struct timespec alogLast;
+static unsigned long alogDropped;
+static unsigned long alogReported;
+static int alogStop;
+static int alogRunning;
+static int alogForked;
+static pthread_t alogWriterTid;
+static pthread_mutex_t alogMutex = PTHREAD_MUTEX_INITIALIZER;
+static char alogOut[ALOG_BATCH];
+
+static int alog_write(const char *buf, size_t count) {
+	ssize_t c;
+	while (count > 0) {
+		c = TEMP_FAILURE_RETRY(write(alogFd, buf, count));
+		if (c <= 0) return -1;
+		buf += c;
+		count -= c;
+	}
+	return 0;
+}
+
+/* Formatting helpers, no locale, no allocation, no stdio */
+static char *alog_put(char *out, char *end, const char *s, int len, int width, int left, char fill) {
+	int padding = width > len ? width - len : 0;
+	if (!left && fill == '0' && len > 0 && (*s == '-' || *s == '+') && out < end) {
+		*out++ = *s++;
+		len--;
+	}
+	if (!left)
+		for (; padding > 0 && out < end; padding--) *out++ = fill;
+	for (; len > 0 && out < end; len--) *out++ = *s++;
+	for (; padding > 0 && out < end; padding--) *out++ = ' ';
+	return out;
+}
+
+static int alog_digits(char *tmp, unsigned long long value, int base, int negative) {
+	char *p = tmp + 24;
+	int len;
+	do {
+		*--p = "0123456789abcdef"[value % base];
+		value /= base;
+	} while (value);
+	if (negative) *--p = '-';
+	len = tmp + 24 - p;
+	memmove(tmp, p, len);
+	return len;
+}
+
+static int alog_double(char *tmp, double value, int precision) {
+	unsigned long long scale = 1, whole, fraction;
+	int len = 0;
+	if (value != value) return memcpy(tmp, "nan", 3), 3;
+	if (value < 0) {
+		tmp[len++] = '-';
+		value = -value;
+	}
+	if (precision > 9) precision = 9;
+	for (int i = 0; i < precision; i++) scale *= 10;
+	if (value >= 1e18 / scale) return memcpy(tmp + len, "inf", 3), len + 3;
+	whole = (unsigned long long)(value * scale + 0.5);
+	fraction = whole % scale;
+	len += alog_digits(tmp + len, whole / scale, 10, 0);
+	if (precision > 0) {
+		tmp[len++] = '.';
+		for (unsigned long long s = scale / 10; s > 0; s /= 10) tmp[len++] = '0' + fraction / s % 10;
+	}
+	return len;
+}
+
+static int alog_vformat(char *buf, int size, const char *fmt, va_list ap) {
+	char *out = buf, *end = buf + size, tmp[48];
+	while (*fmt && out < end) {
+		int width = 0, precision = 6, left = 0, longs = 0, len;
+		char fill = ' ';
+		if (*fmt != '%') {
+			*out++ = *fmt++;
+			continue;
+		}
+		fmt++;
+		for (; *fmt == '-' || *fmt == '0'; fmt++) {
+			if (*fmt == '-') left = 1;
+			else fill = '0';
+		}
+		for (; *fmt >= '0' && *fmt <= '9'; fmt++) width = 10 * width + *fmt - '0';
+		if (*fmt == '.')
+			for (precision = 0, fmt++; *fmt >= '0' && *fmt <= '9'; fmt++) precision = 10 * precision + *fmt - '0';
+		for (; *fmt == 'l' || *fmt == 'z'; fmt++) longs++;
+		switch (*fmt) {
+			case 'd': case 'i': {
+				long long v = longs > 1 ? va_arg(ap, long long) : longs ? va_arg(ap, long) : va_arg(ap, int);
+				len = alog_digits(tmp, v < 0 ? -(unsigned long long)v : (unsigned long long)v, 10, v < 0);
+				out = alog_put(out, end, tmp, len, width, left, fill);
+				break;
+			}
+			case 'u': case 'x': {
+				unsigned long long v = longs > 1 ? va_arg(ap, unsigned long long) : longs ? va_arg(ap, unsigned long) : va_arg(ap, unsigned);
+				len = alog_digits(tmp, v, *fmt == 'x' ? 16 : 10, 0);
+				out = alog_put(out, end, tmp, len, width, left, fill);
+				break;
+			}
+			case 'f':
+				len = alog_double(tmp, va_arg(ap, double), precision);
+				out = alog_put(out, end, tmp, len, width, left, fill);
+				break;
+			case 's': {
+				const char *s = va_arg(ap, const char *);
+				if (s == NULL) s = "(null)";
+				out = alog_put(out, end, s, strlen(s), width, left, ' ');
+				break;
+			}
+			case 'c':
+				tmp[0] = (char)va_arg(ap, int);
+				out = alog_put(out, end, tmp, 1, width, left, ' ');
+				break;
+			case '%':
+				*out++ = '%';
+				break;
+			default:
+				return out - buf;
+		}
+		if (*fmt) fmt++;
+	}
+	if (*fmt && out == end) end[-1] = '\n';
+	return out - buf;
+}
+
+static alogRing_t *alog_ring(void) {
+	if (alogRing < 0) alogRing = __atomic_fetch_add(&alogRingsUsed, 1, __ATOMIC_RELAXED) % ALOG_RINGS;
+	return &alogRings[alogRing];
+}
+
+/* Async-signal-safe, errno is preserved for the interrupted code */
+static void alog(const char *fmt, ...) {
+	int saved = errno;
+	alogRing_t *r;
+	alogSlot_t *slot;
+	unsigned long head, tail;
+	va_list ap;
+	if (alogSync) {
+		char text[ALOG_RECORD];
+		va_start(ap, fmt);
+		int len = alog_vformat(text, ALOG_RECORD, fmt, ap);
+		va_end(ap);
+		alog_write(text, len);
+		errno = saved;
+		return;
+	}
+	r = alog_ring();
+	head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+	do {
+		tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+		if (head - tail >= ALOG_SLOTS) {
+			__atomic_fetch_add(&alogDropped, 1, __ATOMIC_RELAXED);
+			errno = saved;
+			return;
+		}
+	} while (!__atomic_compare_exchange_n(&r->head, &head, head + 1, 1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+	slot = &r->slots[head % ALOG_SLOTS];
+	va_start(ap, fmt);
+	slot->len = alog_vformat(slot->text, ALOG_RECORD, fmt, ap);
+	va_end(ap);
+	__atomic_store_n(&slot->seq, head + 1, __ATOMIC_RELEASE);
+	errno = saved;
+}
+
+/* Token bucket of ALOG_RATE records per second, refilled on every flush */
+static int alog_admit(void) {
+	struct timespec now;
+	if (alogRate <= 0) return 1;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	alogTokens += ((now.tv_sec - alogLast.tv_sec) + (now.tv_nsec - alogLast.tv_nsec) * 1e-9) * alogRate;
+	if (alogTokens > alogRate) alogTokens = alogRate;
+	alogLast = now;
+	if (alogTokens < 1) return 0;
+	alogTokens -= 1;
+	return 1;
+}
+
+/* Moves every published record to the output, a ring stops at the first slot still being formatted */
+static void alog_flush(void) {
+	size_t used = 0;
+	unsigned long dropped;
+	int rings = __atomic_load_n(&alogRingsUsed, __ATOMIC_RELAXED);
+	if (alogFd < 0 || alogSync) return;
+	pthread_mutex_lock(&alogMutex);
+	if (rings > ALOG_RINGS) rings = ALOG_RINGS;
+	for (int i = 0; i < rings; i++) {
+		alogRing_t *r = &alogRings[i];
+		unsigned long tail = r->tail;
+		for (;; tail++) {
+			alogSlot_t *slot = &r->slots[tail % ALOG_SLOTS];
+			if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != tail + 1) break;
+			if (!alog_admit()) __atomic_fetch_add(&alogDropped, 1, __ATOMIC_RELAXED);
+			else {
+				if (used + slot->len > ALOG_BATCH) {
+					alog_write(alogOut, used);
+					used = 0;
+				}
+				memcpy(alogOut + used, slot->text, slot->len);
+				used += slot->len;
+			}
+			__atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+		}
+	}
+	if (used) alog_write(alogOut, used);
+	dropped = __atomic_load_n(&alogDropped, __ATOMIC_RELAXED);
+	if (dropped != alogReported) {
+		char text[64];
+		int len = snprintf(text, sizeof(text), "[alog] %lu records dropped\n", dropped - alogReported);
+		alog_write(text, len);
+		alogReported = dropped;
+	}
+	pthread_mutex_unlock(&alogMutex);
+}
+
+static void *alog_writer(void *unused) {
+	struct timespec t = { 0, ALOG_INTERVAL_MS * 1000000L };
+	(void)unused;
+	while (!__atomic_load_n(&alogStop, __ATOMIC_ACQUIRE)) {
+		nanosleep(&t, NULL);
+		alog_flush();
+	}
+	return NULL;
+}
+
+/* The writer inherits a full signal mask, process signals are never delivered to it */
+static void alog_start(void) {
+	sigset_t all, old;
+	sigfillset(&all);
+	alogStop = 0;
+	if (pthread_sigmask(SIG_SETMASK, &all, &old)) return;
+	alogRunning = !pthread_create(&alogWriterTid, NULL, alog_writer, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+static void alog_exit(void) {
+	if (alogForked) {
+		alogForked = 0;
+		pthread_mutex_init(&alogMutex, NULL);
+	}
+	if (alogRunning) {
+		__atomic_store_n(&alogStop, 1, __ATOMIC_RELEASE);
+		pthread_join(alogWriterTid, NULL);
+		alogRunning = 0;
+	}
+	alog_flush();
+}
+
+/* pthread_atfork child handler, only plain stores: the inherited records are dropped, the lock and the writer are left to alog_child */
+static void alog_fork_child(void) {
+	for (int i = 0; i < ALOG_RINGS; i++) alogRings[i].tail = alogRings[i].head;
+	alogReported = alogDropped;
+	alogRunning = 0;
+	alogForked = 1;
+}
+
+/* Call in the child right after fork returns 0, outside of signal handlers, starts the child's own writer */
+static inline void alog_child(void) {
+	if (!alogForked) return;
+	alogForked = 0;
+	pthread_mutex_init(&alogMutex, NULL);
+	if (alogFd >= 0 && !alogSync) alog_start();
+}
+
+/* Call once in main before any fork or pthread_create, returns -1 if the writer could not start */
+static int alog_init(int fd) {
+	const char *rate = getenv("ALOG_RATE");
+	const char *sync = getenv("ALOG_SYNC");
+	alogFd = fd;
+	alogSync = sync != NULL && *sync;
+	alogRate = rate != NULL ? atof(rate) : 0;
+	alogTokens = alogRate;
+	clock_gettime(CLOCK_MONOTONIC, &alogLast);
+	if (atexit(alog_exit) || pthread_atfork(NULL, NULL, alog_fork_child)) return -1;
+	if (alogSync) return 0;
+	alog_start();
+	return alogRunning ? 0 : -1;
+}
+
+#endif
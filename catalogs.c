@@ -1,30 +1,311 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <time.h>
 #include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include "perfregions.h"
 #define ERR(source) (perror(source),\
 		     fprintf(stderr,"%s:%d\n",__FILE__,__LINE__),\
 		     exit(EXIT_FAILURE))
+#define WRITE_BATCH (1024*1024)
+#define TASK_BATCH 16
+#define MAX_PATH 4096
+#define FILL_PERCENT 10
+#define VERIFY_BLOCK (64*1024)
+#define ELAPSED(start,end) (((end).tv_sec-(start).tv_sec)+(((end).tv_nsec - (start).tv_nsec) * 1.0e-9))
+
+typedef enum sizedist { DIST_FIXED, DIST_UNIFORM, DIST_EXP } sizedist_t;
+typedef struct tree {
+	int rootfd;
+	int depth;
+	int fanout;
+	long files;
+	long dirs;
+	ssize_t size;
+	sizedist_t dist;
+	mode_t perms;
+	long next;
+	long bytes;
+	pthread_mutex_t mxNext;
+	pthread_barrier_t barrier;
+} tree_t;
+typedef struct verifyRange {
+	pthread_t tid;
+	const char *data;
+	off_t start;
+	off_t end;
+	uint64_t seed;
+	off_t mismatch;
+} verifyRange_t;
 
 
 void usage(char* pname){
-	fprintf(stderr,"USAGE:%s -n Name -p OCTAL -s SIZE\n",pname);
+	fprintf(stderr,"USAGE:%s -n Name -p OCTAL -s SIZE [-S SEED] [-c COUNT [-d DEPTH] [-f FANOUT] [-D fixed|uniform|exp] [-t THREADS]]\n",pname);
+	fprintf(stderr,"      %s -n Name -V -S SEED [-t THREADS]\n",pname);
+	fprintf(stderr,"-S - content seed, the same seed always gives the same file (not with -c)\n");
+	fprintf(stderr,"-V - verify existing file against the content of SEED\n");
+	fprintf(stderr,"-c - create directory tree Name with COUNT files of mean size SIZE instead of one file\n");
+	fprintf(stderr,"-d - tree depth (0 - flat directory), -f - subdirectories per directory\n");
+	fprintf(stderr,"-D - file size distribution, -t - number of worker threads\n");
 	exit(EXIT_FAILURE);
 }
 
-void make_file(char *name, ssize_t size, mode_t perms, int percent){
-	FILE* s1;
-	int i;
+/* SplitMix64 output for counter c, any position of the stream can be computed directly */
+uint64_t counter_hash(uint64_t seed, uint64_t c){
+	uint64_t z=seed+c*0x9e3779b97f4a7c15ULL;
+	z=(z^(z>>30))*0xbf58476d1ce4e5b9ULL;
+	z=(z^(z>>27))*0x94d049bb133111ebULL;
+	return z^(z>>31);
+}
+
+static inline char content_byte(unsigned int r, unsigned int threshold){
+	char letter='A'+((((r>>8)&0xff)*('Z'-'A'+1))>>8);
+	return letter&-(char)((r&0xff)<threshold);
+}
+
+#define LANES 0x0001000100010001ULL
+/* content_byte for the four 16 bit lanes of h at once, packed in memory order. below is
+ * (256-threshold) in every lane, the low byte of a lane carries into bit 8 when it is not kept. */
+static inline uint32_t content_word(uint64_t h, uint64_t below){
+	uint64_t letters=((((h>>8)&0xff*LANES)*('Z'-'A'+1)>>8)&0xff*LANES)+'A'*LANES;
+	uint64_t drop=((((h&0xff*LANES)+below)>>8)&LANES)*0xff;
+	uint64_t x=letters&~drop;
+	x=(x|x>>8)&0xffff*(1ULL+(1ULL<<32));
+	x=(x|x>>16)&0xffffffff;
+#if __BYTE_ORDER__==__ORDER_BIG_ENDIAN__
+	x=__builtin_bswap32(x);
+#endif
+	return x;
+}
+
+/* Byte at offset o is a letter with percent probability, zero otherwise. It depends only
+ * on (seed, o), one hash gives 16 bits for each of 4 consecutive bytes. Aligned groups are
+ * computed in one register and written with one store. */
+void fill_content(uint64_t seed, int percent, off_t offset, char *buf, size_t len){
+	unsigned int threshold=percent*256/100;
+	uint64_t below=(256-threshold)*LANES;
+	uint32_t word;
+	size_t i=0;
+	for(;i<len&&((offset+i)&3);i++)
+		buf[i]=content_byte(counter_hash(seed,(offset+i)>>2)>>(16*((offset+i)&3)),threshold);
+	for(;i+4<=len;i+=4){
+		word=content_word(counter_hash(seed,(offset+i)>>2),below);
+		memcpy(buf+i,&word,sizeof(word));
+	}
+	for(;i<len;i++)
+		buf[i]=content_byte(counter_hash(seed,(offset+i)>>2)>>(16*((offset+i)&3)),threshold);
+}
+
+void make_file(char *name, ssize_t size, mode_t perms, int percent, uint64_t seed){
+	int fd;
+	char *buf;
+	ssize_t chunk,c;
+	off_t offset;
+	perfMark_t mark;
 	umask(~perms&0777);
-	if((s1=fopen(name,"w+"))==NULL)ERR("fopen");
-	for(i=0;i<(size*percent)/100;i++){
-		if(fseek(s1,rand()%size,SEEK_SET)) ERR("fseek");
-		fprintf(s1,"%c",'A'+(i%('Z'-'A'+1)));
+	if(NULL==(buf=malloc(WRITE_BATCH)))ERR("malloc");
+	if((fd=TEMP_FAILURE_RETRY(open(name,O_WRONLY|O_CREAT|O_TRUNC,0666)))<0)ERR("open");
+	for(offset=0;offset<size;offset+=c){
+		chunk=size-offset<WRITE_BATCH?size-offset:WRITE_BATCH;
+		perf_begin(&mark,"fill_content");
+		fill_content(seed,percent,offset,buf,chunk);
+		perf_end(&mark);
+		perf_begin(&mark,"write");
+		if((c=TEMP_FAILURE_RETRY(write(fd,buf,chunk)))<0)ERR("write");
+		perf_end(&mark);
 	}
-	if(fclose(s1))ERR("fclose");
+	if(close(fd))ERR("close");
+	free(buf);
+}
+
+void* verify_worker(void* voidArgs){
+	verifyRange_t *range=voidArgs;
+	char expected[VERIFY_BLOCK];
+	off_t offset;
+	size_t len,i;
+	perfMark_t mark;
+	long page=sysconf(_SC_PAGESIZE);
+	perf_begin(&mark,"verify_worker");
+	/* every worker faults in its own range, read ahead of the compare */
+	if(range->end>range->start){
+		off_t first=range->start&~(off_t)(page-1);
+		if(madvise((char*)range->data+first,range->end-first,MADV_WILLNEED))ERR("madvise");
+	}
+	for(offset=range->start;offset<range->end;offset+=len){
+		len=range->end-offset<VERIFY_BLOCK?range->end-offset:VERIFY_BLOCK;
+		fill_content(range->seed,FILL_PERCENT,offset,expected,len);
+		if(memcmp(expected,range->data+offset,len)){
+			for(i=0;expected[i]==range->data[offset+i];i++);
+			range->mismatch=offset+i;
+			break;
+		}
+	}
+	perf_end(&mark);
+	return NULL;
+}
+
+/* Splits the mapped file into one contiguous range per thread, the lowest mismatch wins.
+ * The mapping is not populated here, the pages of a cold file are read by the workers in parallel. */
+int verify_file(char *name, uint64_t seed, int threads){
+	int fd;
+	struct stat st;
+	struct timespec start,end;
+	char *data;
+	off_t mismatch=-1;
+	verifyRange_t *ranges;
+	double elapsed;
+	if((fd=TEMP_FAILURE_RETRY(open(name,O_RDONLY)))<0)ERR("open");
+	if(fstat(fd,&st))ERR("fstat");
+	if(NULL==(ranges=malloc(sizeof(verifyRange_t)*threads)))ERR("malloc");
+	if(clock_gettime(CLOCK_MONOTONIC,&start))ERR("clock_gettime");
+	data=NULL;
+	if(st.st_size>0){
+		if(MAP_FAILED==(data=mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0)))ERR("mmap");
+		if(madvise(data,st.st_size,MADV_SEQUENTIAL))ERR("madvise");
+	}
+	for(int i=0;i<threads;i++){
+		ranges[i].data=data;
+		ranges[i].start=st.st_size*i/threads;
+		ranges[i].end=st.st_size*(i+1)/threads;
+		ranges[i].seed=seed;
+		ranges[i].mismatch=-1;
+		if(pthread_create(&ranges[i].tid,NULL,verify_worker,&ranges[i]))ERR("pthread_create");
+	}
+	for(int i=0;i<threads;i++){
+		if(pthread_join(ranges[i].tid,NULL))ERR("pthread_join");
+		if(mismatch<0) mismatch=ranges[i].mismatch;
+	}
+	if(clock_gettime(CLOCK_MONOTONIC,&end))ERR("clock_gettime");
+	elapsed=ELAPSED(start,end);
+	if(mismatch>=0){
+		char expected;
+		fill_content(seed,FILL_PERCENT,mismatch,&expected,1);
+		printf("MISMATCH at offset %ld: expected 0x%02x, found 0x%02x\n",(long)mismatch,(unsigned char)expected,(unsigned char)data[mismatch]);
+	}
+	else printf("OK: %ld bytes verified in %.3f s, %.2f GB/s\n",(long)st.st_size,elapsed,st.st_size/elapsed/(1024*1024*1024));
+	if(data&&munmap(data,st.st_size))ERR("munmap");
+	if(close(fd))ERR("close");
+	free(ranges);
+	return mismatch<0?EXIT_SUCCESS:EXIT_FAILURE;
+}
+
+/* directories are numbered in BFS order, parent of j is (j-1)/fanout */
+void dir_path(tree_t *tree, long j, char *path){
+	char tmp[MAX_PATH];
+	path[0]='.';
+	path[1]=0;
+	while(j>0){
+		snprintf(tmp,MAX_PATH,"d%ld/%s",(j-1)%tree->fanout,path);
+		strcpy(path,tmp);
+		j=(j-1)/tree->fanout;
+	}
+}
+
+ssize_t file_size(tree_t *tree, long i){
+	unsigned int seed=i;
+	double u=(rand_r(&seed)+1.0)/(RAND_MAX+2.0);
+	switch(tree->dist){
+		case DIST_UNIFORM: return (ssize_t)(u*2*tree->size);
+		case DIST_EXP: return (ssize_t)(-log(u)*tree->size);
+		default: return tree->size;
+	}
+}
+
+/* creates subdirectories and files of directory j, returns bytes written */
+long fill_dir(tree_t *tree, long j, int level, char *buf){
+	char path[MAX_PATH],name[32];
+	int dfd,fd;
+	long i,bytes=0;
+	ssize_t size,chunk,c;
+	dir_path(tree,j,path);
+	if((dfd=openat(tree->rootfd,path,O_RDONLY|O_DIRECTORY))<0)ERR("openat");
+	if(level<tree->depth)
+		for(i=0;i<tree->fanout;i++){
+			snprintf(name,sizeof(name),"d%ld",i);
+			if(mkdirat(dfd,name,tree->perms|((tree->perms&0444)>>2)|0200))ERR("mkdirat");
+		}
+	for(i=j;i<tree->files;i+=tree->dirs){
+		snprintf(name,sizeof(name),"f%ld",i);
+		if((fd=openat(dfd,name,O_WRONLY|O_CREAT|O_TRUNC,tree->perms))<0)ERR("openat");
+		for(size=file_size(tree,i);size>0;size-=c){
+			chunk=size<WRITE_BATCH?size:WRITE_BATCH;
+			if((c=TEMP_FAILURE_RETRY(write(fd,buf+i%('Z'-'A'+1),chunk)))<0)ERR("write");
+			bytes+=c;
+		}
+		if(close(fd))ERR("close");
+	}
+	if(close(dfd))ERR("close");
+	return bytes;
+}
+
+/* Levels are processed one after another, directories of one level are taken
+ * from a shared counter in batches of TASK_BATCH */
+void* tree_worker(void* voidArgs){
+	tree_t *tree=voidArgs;
+	long j,end,bytes=0,levelStart=0,levelSize=1;
+	char *buf;
+	perfMark_t mark;
+	if(NULL==(buf=malloc(WRITE_BATCH+'Z'-'A'+1)))ERR("malloc");
+	for(j=0;j<WRITE_BATCH+'Z'-'A'+1;j++) buf[j]='A'+(j%('Z'-'A'+1));
+	for(int level=0;level<=tree->depth;level++){
+		for(;;){
+			pthread_mutex_lock(&tree->mxNext);
+			j=tree->next;
+			end=j+TASK_BATCH<levelStart+levelSize?j+TASK_BATCH:levelStart+levelSize;
+			if(j<end) tree->next=end;
+			pthread_mutex_unlock(&tree->mxNext);
+			if(j>=end) break;
+			perf_begin(&mark,"fill_dir");
+			for(;j<end;j++) bytes+=fill_dir(tree,j,level,buf);
+			perf_end(&mark);
+		}
+		levelStart+=levelSize;
+		levelSize*=tree->fanout;
+		pthread_barrier_wait(&tree->barrier);
+	}
+	pthread_mutex_lock(&tree->mxNext);
+	tree->bytes+=bytes;
+	pthread_mutex_unlock(&tree->mxNext);
+	free(buf);
+	return NULL;
+}
+
+void make_tree(char *name, tree_t *tree, int threads){
+	pthread_t *tids;
+	struct timespec start,end;
+	long levelSize=1;
+	double elapsed;
+	umask(0);
+	tree->dirs=0;
+	for(int level=0;level<=tree->depth;level++,levelSize*=tree->fanout) tree->dirs+=levelSize;
+	tree->next=0;
+	tree->bytes=0;
+	if(clock_gettime(CLOCK_MONOTONIC,&start))ERR("clock_gettime");
+	if(mkdir(name,tree->perms|((tree->perms&0444)>>2)|0200))ERR("mkdir");
+	if((tree->rootfd=open(name,O_RDONLY|O_DIRECTORY))<0)ERR("open");
+	if(pthread_mutex_init(&tree->mxNext,NULL))ERR("pthread_mutex_init");
+	if(pthread_barrier_init(&tree->barrier,NULL,threads))ERR("pthread_barrier_init");
+	if(NULL==(tids=malloc(sizeof(pthread_t)*threads)))ERR("malloc");
+	for(int i=0;i<threads;i++)
+		if(pthread_create(&tids[i],NULL,tree_worker,tree))ERR("pthread_create");
+	for(int i=0;i<threads;i++)
+		if(pthread_join(tids[i],NULL))ERR("pthread_join");
+	if(close(tree->rootfd))ERR("close");
+	if(clock_gettime(CLOCK_MONOTONIC,&end))ERR("clock_gettime");
+	elapsed=ELAPSED(start,end);
+	printf("%ld directories, %ld files, %ld bytes in %.3f s: %.0f files/s, %.2f MB/s\n",
+		tree->dirs,tree->files,tree->bytes,elapsed,tree->files/elapsed,tree->bytes/elapsed/(1024*1024));
+	pthread_barrier_destroy(&tree->barrier);
+	pthread_mutex_destroy(&tree->mxNext);
+	free(tids);
 }
 
 int main(int argc, char** argv) {
@@ -32,7 +313,12 @@ int main(int argc, char** argv) {
 	char *name=NULL;
 	mode_t perms=-1;
 	ssize_t size=-1;
-	while ((c = getopt (argc, argv, "p:n:s:")) != -1)
+	int threads=sysconf(_SC_NPROCESSORS_ONLN);
+	tree_t tree={.depth=0,.fanout=1,.files=0,.dist=DIST_FIXED};
+	uint64_t seed=0;
+	int seeded=0,verify=0;
+	perf_init();
+	while ((c = getopt (argc, argv, "p:n:s:c:d:f:D:t:S:V")) != -1)
 		switch (c)
 		{
 			case 'p':
@@ -44,13 +330,59 @@ int main(int argc, char** argv) {
 			case 'n':
 				name=optarg;
 				break;
+			case 'c':
+				tree.files=strtol(optarg, (char **)NULL, 10);
+				if(tree.files<=0) usage(argv[0]);
+				break;
+			case 'd':
+				tree.depth=strtol(optarg, (char **)NULL, 10);
+				if(tree.depth<0) usage(argv[0]);
+				break;
+			case 'f':
+				tree.fanout=strtol(optarg, (char **)NULL, 10);
+				if(tree.fanout<=0) usage(argv[0]);
+				break;
+			case 'D':
+				if(!strcmp(optarg,"fixed")) tree.dist=DIST_FIXED;
+				else if(!strcmp(optarg,"uniform")) tree.dist=DIST_UNIFORM;
+				else if(!strcmp(optarg,"exp")) tree.dist=DIST_EXP;
+				else usage(argv[0]);
+				break;
+			case 't':
+				threads=strtol(optarg, (char **)NULL, 10);
+				if(threads<=0) usage(argv[0]);
+				break;
+			case 'S':
+				seed=strtoull(optarg, (char **)NULL, 10);
+				seeded=1;
+				break;
+			case 'V':
+				verify=1;
+				break;
 			case '?':
 			default:
 				usage(argv[0]);
 		}
+	if(verify){
+		if(NULL==name||!seeded) usage(argv[0]);
+		return verify_file(name,seed,threads);
+	}
 	if((NULL==name)||(-1==perms)||(-1==size)) usage(argv[0]);
+	if(tree.files>0){
+		if(seeded){
+			fprintf(stderr,"-S can not be used with -c, tree files do not take their content from the seed\n");
+			usage(argv[0]);
+		}
+		tree.size=size;
+		tree.perms=perms&0777;
+		make_tree(name,&tree,threads);
+		return EXIT_SUCCESS;
+	}
 	if(unlink(name)&&errno!=ENOENT)ERR("unlink");
-	srand(time(NULL));
-	make_file(name,size,perms,10);
+	if(!seeded){
+		seed=time(NULL);
+		fprintf(stderr,"Seed: %llu\n",(unsigned long long)seed);
+	}
+	make_file(name,size,perms,FILL_PERCENT,seed);
 	return EXIT_SUCCESS;
 }
\ No newline at end of file
@@ -0,0 +1,208 @@
+#ifndef PERFREGIONS_H
+#define PERFREGIONS_H
+/*
+Hardware counters around named regions, enabled with the PERF_REGIONS environment variable (off by default, then perf_begin and perf_end only test a flag).
+perf_init has to be called in main before any fork or pthread_create. Every thread (and every child process) opens its own counter group on the first perf_begin, counts are read with one read call at both ends of the region and added to a table in a MAP_SHARED mapping, so children and threads all report into the table of the process that called perf_init. That process prints the summary to stderr at exit, only on a normal exit (return from main or exit), a program stopped by a signal such as 15.c prints nothing.
+Counted: cycles, instructions, cache misses and branch misses (user space only, accepted with perf_event_paranoid up to 2) plus wall time and context switches (getrusage RUSAGE_THREAD, always available). When perf_event_open is refused (perf_event_paranoid 3, no PMU in a virtual machine, seccomp) the hardware columns are printed as n/a and everything else still works.
+Usage:
+	perfMark_t mark;
+	perf_begin(&mark, "reversebuffer");
+	...
+	perf_end(&mark);
+*/
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#define PERF_MAXREGIONS 32
+#define PERF_NAMELEN 32
+#define PERF_COUNTERS 4
+
+typedef struct perfRegion {
+	char name[PERF_NAMELEN];
+	long calls;
+	long long ns;
+	long long csw;
+	long long counts[PERF_COUNTERS];
+} perfRegion_t;
+
+typedef struct perfTable {
+	int lock;
+	int count;
+	int warned;
+	int available[PERF_COUNTERS];
+	perfRegion_t regions[PERF_MAXREGIONS];
+} perfTable_t;
+
+typedef struct perfMark {
+	int region;
+	long long ns;
+	long csw;
+	unsigned long long counts[PERF_COUNTERS];
+} perfMark_t;
+
+static const char *perfNames[PERF_COUNTERS] = { "cycles", "instructions", "cache-misses", "branch-misses" };
+static const unsigned long long perfConfigs[PERF_COUNTERS] = {
+	PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+};
+
+static perfTable_t *perfTable = NULL;
+static pid_t perfOwner;
+static pthread_key_t perfKey;
+/* per thread counter group: leader fd, pid that opened it, position of every counter in the group read (-1 - not counted) */
+static __thread int perfFd = -1;
+static __thread pid_t perfFdPid;
+static __thread int perfSlot[PERF_COUNTERS];
+
+static long long perf_ns(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (long long)t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+static long perf_csw(void) {
+	struct rusage ru;
+	if (getrusage(RUSAGE_THREAD, &ru)) return 0;
+	return ru.ru_nvcsw + ru.ru_nivcsw;
+}
+
+static int perf_paranoid(void) {
+	int level = -1;
+	FILE *f = fopen("/proc/sys/kernel/perf_event_paranoid", "r");
+	if (f == NULL) return -1;
+	if (fscanf(f, "%d", &level) != 1) level = -1;
+	fclose(f);
+	return level;
+}
+
+static void perf_close(void *unused) {
+	(void)unused;
+	if (perfFd >= 0) close(perfFd);
+	perfFd = -1;
+}
+
+/* opens the group of the calling thread, counters the kernel refuses are left out of it */
+static void perf_open(void) {
+	struct perf_event_attr attr;
+	int fd, n = 0, err = 0;
+	if (perfFd >= 0 && perfFdPid == getpid()) return;
+	/* a child inherits the fd of the forking thread, which still counts the parent */
+	if (perfFd >= 0) close(perfFd);
+	perfFd = -1;
+	perfFdPid = getpid();
+	for (int i = 0; i < PERF_COUNTERS; i++) {
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = perfConfigs[i];
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_GROUP;
+		perfSlot[i] = -1;
+		if ((fd = syscall(SYS_perf_event_open, &attr, 0, -1, perfFd, 0)) < 0) {
+			err = errno;
+			continue;
+		}
+		if (perfFd < 0) perfFd = fd;
+		perfSlot[i] = n++;
+		perfTable->available[i] = 1;
+	}
+	if (err && !__atomic_exchange_n(&perfTable->warned, 1, __ATOMIC_RELAXED))
+		fprintf(stderr, "perf: some counters unavailable (%s, perf_event_paranoid=%d), they are reported as n/a\n",
+			strerror(err), perf_paranoid());
+	pthread_setspecific(perfKey, &perfFd);
+}
+
+static int perf_read(unsigned long long *counts) {
+	unsigned long long buf[PERF_COUNTERS + 1];
+	if (perfFd < 0 || read(perfFd, buf, sizeof(buf)) < (ssize_t)sizeof(unsigned long long)) return -1;
+	for (int i = 0; i < PERF_COUNTERS; i++)
+		counts[i] = perfSlot[i] >= 0 ? buf[1 + perfSlot[i]] : 0;
+	return 0;
+}
+
+static int perf_region(const char *name) {
+	int i;
+	while (__atomic_exchange_n(&perfTable->lock, 1, __ATOMIC_ACQUIRE));
+	for (i = 0; i < perfTable->count; i++)
+		if (!strncmp(perfTable->regions[i].name, name, PERF_NAMELEN - 1)) break;
+	if (i == perfTable->count) {
+		if (i < PERF_MAXREGIONS) {
+			strncpy(perfTable->regions[i].name, name, PERF_NAMELEN - 1);
+			perfTable->count++;
+		} else i = -1;
+	}
+	__atomic_store_n(&perfTable->lock, 0, __ATOMIC_RELEASE);
+	return i;
+}
+
+static void perf_report(void) {
+	perfRegion_t *r;
+	if (perfTable == NULL || getpid() != perfOwner) return;
+	fprintf(stderr, "%-20s %10s %12s %10s", "region", "calls", "time [ms]", "ctx-sw");
+	for (int j = 0; j < PERF_COUNTERS; j++) fprintf(stderr, " %14s", perfNames[j]);
+	fprintf(stderr, " %6s\n", "IPC");
+	for (int i = 0; i < perfTable->count; i++) {
+		r = &perfTable->regions[i];
+		fprintf(stderr, "%-20s %10ld %12.3f %10lld", r->name, r->calls, r->ns * 1e-6, r->csw);
+		for (int j = 0; j < PERF_COUNTERS; j++)
+			if (perfTable->available[j]) fprintf(stderr, " %14lld", r->counts[j]);
+			else fprintf(stderr, " %14s", "n/a");
+		if (perfTable->available[0] && perfTable->available[1] && r->counts[0])
+			fprintf(stderr, " %6.2f\n", (double)r->counts[1] / r->counts[0]);
+		else fprintf(stderr, " %6s\n", "n/a");
+	}
+}
+
+/* does nothing unless PERF_REGIONS is set, call before the first fork or pthread_create */
+static void perf_init(void) {
+	const char *env = getenv("PERF_REGIONS");
+	if (env == NULL || *env == 0 || perfTable != NULL) return;
+	perfTable = mmap(NULL, sizeof(perfTable_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (perfTable == MAP_FAILED) {
+		perfTable = NULL;
+		fprintf(stderr, "perf: cannot map region table, instrumentation disabled\n");
+		return;
+	}
+	perfOwner = getpid();
+	pthread_key_create(&perfKey, perf_close);
+	atexit(perf_report);
+}
+
+static void perf_begin(perfMark_t *m, const char *name) {
+	m->region = -1;
+	if (perfTable == NULL) return;
+	perf_open();
+	if ((m->region = perf_region(name)) < 0) return;
+	m->csw = perf_csw();
+	m->ns = perf_ns();
+	perf_read(m->counts);
+}
+
+static void perf_end(perfMark_t *m) {
+	unsigned long long counts[PERF_COUNTERS];
+	perfRegion_t *r;
+	if (m->region < 0) return;
+	int counted = perf_read(counts) == 0;
+	long long ns = perf_ns();
+	r = &perfTable->regions[m->region];
+	__atomic_fetch_add(&r->calls, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&r->ns, ns - m->ns, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&r->csw, perf_csw() - m->csw, __ATOMIC_RELAXED);
+	if (counted)
+		for (int i = 0; i < PERF_COUNTERS; i++)
+			__atomic_fetch_add(&r->counts[i], counts[i] - m->counts[i], __ATOMIC_RELAXED);
+}
+
+#endif
@@ -0,0 +1,111 @@
+#ifndef PRNG_H
+#define PRNG_H
+/*
+Splittable pseudo random streams (xoshiro256**), a replacement for rand, srand and rand_r.
+rand keeps its state behind a lock in glibc, rand_r has only 32 bits of state and seeding every thread or child with time or pid gives runs that can not be repeated. Here the program seeds one master stream with prng_master (PRNG_SEED environment variable, otherwise time and pid, the seed is printed to stderr so the run can be repeated) and hands every thread or child its own stream with prng_split. prng_jump moves a stream 2^128 steps ahead, so split streams never overlap.
+Before fork it is enough to call prng_jump in the parent after every fork, each child keeps the state it inherited, as long as the child does not split streams of its own and the parent draws nothing after the forks (a child that splits moves its stream onto the next child's). Otherwise split a stream for every child with prng_split before fork and let the child use only that.
+The state is 32 bytes with no locking, a thread keeps its stream in a local variable. Batch functions (prng_fill_double, prng_fill_below) keep the state in registers for the whole array.
+Usage:
+	prng_t master, stream;
+	prng_seed(&master, prng_master());
+	prng_split(&master, &stream);
+	int die = 1 + prng_below(&stream, 6);
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct prng {
+	uint64_t s[4];
+} prng_t;
+
+static inline uint64_t prng_rotl(uint64_t x, int k) {
+	return (x << k) | (x >> (64 - k));
+}
+
+/* splitmix64, expands one 64 bit seed into the 256 bit state */
+static inline uint64_t prng_splitmix(uint64_t *x) {
+	uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static inline void prng_seed(prng_t *p, uint64_t seed) {
+	for (int i = 0; i < 4; i++) p->s[i] = prng_splitmix(&seed);
+}
+
+static inline uint64_t prng_next(prng_t *p) {
+	uint64_t *s = p->s;
+	uint64_t result = prng_rotl(s[1] * 5, 7) * 9, t = s[1] << 17;
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = prng_rotl(s[3], 45);
+	return result;
+}
+
+/* equivalent to 2^128 calls of prng_next */
+static inline void prng_jump(prng_t *p) {
+	static const uint64_t jump[4] = { 0x180ec6d33cfd0abaULL, 0xd5a61266f0c9392cULL, 0xa9582618e03fc9aaULL, 0x39abdc4529b1661cULL };
+	uint64_t s[4] = { 0, 0, 0, 0 };
+	for (int i = 0; i < 4; i++)
+		for (int b = 0; b < 64; b++) {
+			if (jump[i] & (1ULL << b))
+				for (int j = 0; j < 4; j++) s[j] ^= p->s[j];
+			prng_next(p);
+		}
+	for (int j = 0; j < 4; j++) p->s[j] = s[j];
+}
+
+/* child gets the current stream, parent jumps past it */
+static inline void prng_split(prng_t *parent, prng_t *child) {
+	*child = *parent;
+	prng_jump(parent);
+}
+
+/* uniform double in [0,1) from the top 53 bits */
+static inline double prng_double(prng_t *p) {
+	return (prng_next(p) >> 11) * 0x1.0p-53;
+}
+
+/* uniform integer in [0,n), multiply and shift with rejection (Lemire), no division on the fast path */
+static inline uint32_t prng_below(prng_t *p, uint32_t n) {
+	uint64_t m = (prng_next(p) >> 32) * n;
+	if ((uint32_t)m < n) {
+		uint32_t threshold = -n % n;
+		while ((uint32_t)m < threshold) m = (prng_next(p) >> 32) * n;
+	}
+	return m >> 32;
+}
+
+static inline void prng_fill_double(prng_t *p, double *out, size_t count) {
+	prng_t s = *p;
+	for (size_t i = 0; i < count; i++) out[i] = prng_double(&s);
+	*p = s;
+}
+
+static inline void prng_fill_below(prng_t *p, uint32_t *out, size_t count, uint32_t n) {
+	prng_t s = *p;
+	for (size_t i = 0; i < count; i++) out[i] = prng_below(&s, n);
+	*p = s;
+}
+
+/* master seed of the run: PRNG_SEED if set, otherwise from time and pid and printed to stderr */
+static inline uint64_t prng_master(void) {
+	const char *env = getenv("PRNG_SEED");
+	struct timespec t;
+	uint64_t seed;
+	if (env != NULL && *env) return strtoull(env, NULL, 10);
+	clock_gettime(CLOCK_REALTIME, &t);
+	seed = ((uint64_t)t.tv_sec * 1000000000ULL + t.tv_nsec) ^ ((uint64_t)getpid() << 32);
+	fprintf(stderr, "PRNG_SEED=%llu\n", (unsigned long long)seed);
+	return seed;
+}
+
+#endif
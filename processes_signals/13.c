@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -6,18 +7,64 @@
 #include <errno.h>
 #include <string.h>
 #include <time.h>
+#include <signal.h>
+#include "../perfregions.h"
+#include "../prng.h"
 #define ERR(source) (fprintf(stderr,"%s:%d\n",__FILE__,__LINE__),\
                      perror(source),kill(0,SIGKILL),\
 		     		     exit(EXIT_FAILURE))
+#define BACKOFF_MS 100
+#define BACKOFF_MAX_MS 5000
+#define BACKOFF_SHIFT_MAX 16
+#define CPU_UNIT_MS 10
 
+typedef enum jobState { JOB_PENDING, JOB_RUNNING, JOB_DONE, JOB_FAILED } jobState_t;
+typedef struct job {
+	pid_t pid;
+	jobState_t state;
+	int attempts;
+	double notBefore;
+	double started;
+	double elapsed;
+} job_t;
+typedef struct summary {
+	int jobs;
+	int failed;
+	int restarts;
+	double makespan;
+	double meanRun;
+	double meanLatency;
+} summary_t;
+
+prng_t rng;
+
+double now(void) {
+	struct timespec t;
+	if(clock_gettime(CLOCK_MONOTONIC,&t)) ERR("clock_gettime:");
+	return t.tv_sec+t.tv_nsec*1e-9;
+}
 
 void child_work(int i) {
-	srand(time(NULL)*getpid());	
-	int t=5+rand()%(10-5+1);
+	perfMark_t mark;
+	perf_begin(&mark,"child_work");
+	int t=5+prng_below(&rng,10-5+1);
 	sleep(t);
+	perf_end(&mark);
 	printf("PROCESS with pid %d terminates\n",getpid());
 }
 
+/* Benchmark job: the same 5..10 range, but in units of CPU_UNIT_MS of CPU time, so jobs compete for the CPUs */
+void cpu_work(int i) {
+	struct timespec t;
+	(void)i;
+	double limit=(5+prng_below(&rng,10-5+1))*CPU_UNIT_MS*1e-3;
+	volatile uint64_t sink=0;
+	do {
+		for(int j=0;j<10000;j++) sink+=prng_next(&rng);
+		if(clock_gettime(CLOCK_PROCESS_CPUTIME_ID,&t)) ERR("clock_gettime:");
+	} while(t.tv_sec+t.tv_nsec*1e-9<limit);
+}
+
 void create_children(int n) {
 	pid_t s;
 	for (n--;n>=0;n--) {
@@ -26,19 +73,154 @@ void create_children(int n) {
 			child_work(n);
 			exit(EXIT_SUCCESS);
 		}
+		prng_jump(&rng);
+	}
+}
+
+void start_job(job_t *jobs, int i, void (*work)(int), sigset_t *oldmask) {
+	pid_t s;
+	fflush(stdout);
+	if((s=fork())<0) ERR("Fork:");
+	if(!s) {
+		if(sigprocmask(SIG_SETMASK,oldmask,NULL)) ERR("sigprocmask:");
+		work(i);
+		exit(EXIT_SUCCESS);
+	}
+	prng_jump(&rng);
+	jobs[i].pid=s;
+	jobs[i].state=JOB_RUNNING;
+	jobs[i].started=now();
+	jobs[i].attempts++;
+}
+
+/* Pending job that may start now, otherwise the earliest time one may (0 if none is left) */
+int next_job(job_t *jobs, int n, double t, double *wakeup) {
+	*wakeup=0;
+	for(int i=0;i<n;i++) {
+		if(JOB_PENDING!=jobs[i].state) continue;
+		if(jobs[i].notBefore<=t) return i;
+		if(0==*wakeup||jobs[i].notBefore<*wakeup) *wakeup=jobs[i].notBefore;
+	}
+	return -1;
+}
+
+/* A failed job (non zero status or killed) goes back to pending with exponential backoff while it has retries left.
+ * All jobs are submitted at start, latency includes the wait for a free slot. */
+void finish_job(job_t *job, int i, int status, int retries, int verbose, double start, summary_t *sum) {
+	double t=now();
+	job->elapsed=t-job->started;
+	sum->meanRun+=job->elapsed;
+	if(WIFEXITED(status)&&EXIT_SUCCESS==WEXITSTATUS(status)) {
+		job->state=JOB_DONE;
+		sum->meanLatency+=t-start;
+		if(verbose) printf("SUPERVISOR: job %d (pid %d) done in %.3f s, attempt %d\n",i,job->pid,job->elapsed,job->attempts);
+		return;
+	}
+	if(job->attempts<=retries) {
+		int shift=job->attempts-1<BACKOFF_SHIFT_MAX?job->attempts-1:BACKOFF_SHIFT_MAX;
+		int delay=BACKOFF_MS<<shift;
+		if(delay>BACKOFF_MAX_MS) delay=BACKOFF_MAX_MS;
+		job->state=JOB_PENDING;
+		job->notBefore=t+delay*1e-3;
+		sum->restarts++;
+		if(verbose) printf("SUPERVISOR: job %d (pid %d) failed after %.3f s, restart in %d ms\n",i,job->pid,job->elapsed,delay);
+		return;
+	}
+	job->state=JOB_FAILED;
+	sum->failed++;
+	sum->meanLatency+=t-start;
+	if(verbose) printf("SUPERVISOR: job %d (pid %d) failed after %.3f s, no retries left\n",i,job->pid,job->elapsed);
+}
+
+/* Runs n jobs, at most k at once. SIGCHLD is blocked and taken with sigtimedwait, so the next job
+ * starts as soon as one exits, the timeout only wakes the supervisor for a restart after backoff. */
+summary_t supervise(int n, int k, int retries, void (*work)(int), int verbose) {
+	job_t *jobs;
+	summary_t sum={n,0,0,0,0,0};
+	sigset_t chld, oldmask;
+	struct timespec timeout;
+	double start, wakeup;
+	int running=0, finished=0, i, status;
+	pid_t pid;
+	if(NULL==(jobs=calloc(n,sizeof(job_t)))) ERR("calloc:");
+	sigemptyset(&chld);
+	sigaddset(&chld,SIGCHLD);
+	if(sigprocmask(SIG_BLOCK,&chld,&oldmask)) ERR("sigprocmask:");
+	start=now();
+	while(finished<n) {
+		while((pid=waitpid(0,&status,WNOHANG))>0) {
+			for(i=0;i<n&&(JOB_RUNNING!=jobs[i].state||jobs[i].pid!=pid);i++);
+			if(i==n) continue;
+			running--;
+			finish_job(&jobs[i],i,status,retries,verbose,start,&sum);
+			if(JOB_PENDING!=jobs[i].state) finished++;
+		}
+		if(pid<0&&ECHILD!=errno) ERR("waitpid:");
+		while(running<k&&(i=next_job(jobs,n,now(),&wakeup))>=0) {
+			start_job(jobs,i,work,&oldmask);
+			running++;
+		}
+		if(finished==n) break;
+		if(running<k&&wakeup>0) {
+			double left=wakeup-now();
+			if(left<0) left=0;
+			timeout.tv_sec=(time_t)left;
+			timeout.tv_nsec=(long)((left-timeout.tv_sec)*1e9);
+			if(sigtimedwait(&chld,NULL,&timeout)<0&&EAGAIN!=errno&&EINTR!=errno) ERR("sigtimedwait:");
+		} else if(sigwaitinfo(&chld,NULL)<0&&EINTR!=errno) ERR("sigwaitinfo:");
+	}
+	sum.makespan=now()-start;
+	sum.meanRun/=n+sum.restarts;
+	sum.meanLatency/=n;
+	if(sigprocmask(SIG_SETMASK,&oldmask,NULL)) ERR("sigprocmask:");
+	free(jobs);
+	return sum;
+}
+
+/* All at once (k=n) against bounded k and a few other limits, same CPU bound jobs */
+void benchmark(int n, int k) {
+	int limits[]={n,k,1,2,4,8};
+	printf("limit\tmakespan[s]\tjobs/s\tmean run[s]\tmean latency[s]\n");
+	for(int l=0;l<(int)(sizeof(limits)/sizeof(limits[0]));l++) {
+		if(limits[l]>n||(l==1&&k==n)||(l>1&&(limits[l]==k||limits[l]==n))) continue;
+		summary_t sum=supervise(n,limits[l],0,cpu_work,0);
+		printf("%d%s\t%.3f\t%.2f\t%.3f\t%.3f\n",limits[l],limits[l]==n?" (all)":"",sum.makespan,
+			sum.jobs/sum.makespan,sum.meanRun,sum.meanLatency);
 	}
 }
 
 void usage(char *name){
-	fprintf(stderr,"USAGE: %s 0<n\n",name);
+	fprintf(stderr,"USAGE: %s 0<n [0<k [0<=retries]]\n",name);
+	fprintf(stderr,"       %s -b 0<n 0<k\n",name);
 	exit(EXIT_FAILURE);
 }
 
 int main(int argc, char** argv) {
-	int n;
+	int n, k, retries=0;
 	if(argc<2)  usage(argv[0]);
+	if(!strcmp(argv[1],"-b")) {
+		if(argc!=4) usage(argv[0]);
+		n=atoi(argv[2]);
+		k=atoi(argv[3]);
+		if(n<=0||k<=0)  usage(argv[0]);
+		perf_init();
+		prng_seed(&rng,prng_master());
+		benchmark(n,k);
+		return EXIT_SUCCESS;
+	}
 	n=atoi(argv[1]);
 	if(n<=0)  usage(argv[0]);
+	perf_init();
+	prng_seed(&rng,prng_master());
+	if(argc>=3) {
+		k=atoi(argv[2]);
+		if(argc>=4) retries=atoi(argv[3]);
+		if(k<=0||retries<0)  usage(argv[0]);
+		summary_t sum=supervise(n,k,retries,child_work,1);
+		printf("SUPERVISOR: %d jobs (%d failed, %d restarts) in %.3f s, %.2f jobs/s, mean run %.3f s, mean latency %.3f s\n",
+			sum.jobs,sum.failed,sum.restarts,sum.makespan,sum.jobs/sum.makespan,sum.meanRun,sum.meanLatency);
+		return EXIT_SUCCESS;
+	}
 	create_children(n);
 	while(n>0){
 		sleep(3);
@@ -67,10 +249,10 @@ Why after you run this program the command line returns immediately while proces
 Ad.:Parent process is not waiting for child processes, no wait or waitpid call. It will be fixed in the 2nd stage.
 How to check the current parent of the created sub-processes (after the initial parent quits)? Why this process?
 Ad: Right after the command line returns run: $ps -f, you should see that the PPID (parent PID) is 1 (init/systemd). It is caused by premature end of parent process, the orphaned processes can not "hang" outside of process three so they have to be attached somewhere. To make it simple, it is not the shell but the first process in the system.
-Random number generator seed is set in child process, can it be moved to parent process? Will it affect the program?
-Ad:Child processes will get the same "random" numbers because they will have the same random seed. Seeding can not be moved to parent.
-Can we change the seed from PID to time() call?
-Ad:No. Time you get from time() is returned in seconds since 1970, in most cases all sub-processes will have the same seed and will get the same (not random) numbers.
+Random number generator is seeded once in the parent, before any fork, why do the children not get the same numbers?
+Ad:Every child inherits the generator state at the moment of fork and the parent calls prng_jump after each fork, so the next child starts 2^128 steps further and every child draws from its own stream that never overlaps the others (../prng.h). Without the jump all children would copy the same state and get the same "random" numbers.
+Could every child seed its own generator with time() instead?
+Ad:No. Time you get from time() is returned in seconds since 1970, in most cases all sub-processes will have the same seed and will get the same (not random) numbers. One seed in the parent (printed as PRNG_SEED) also lets you repeat the whole run.
 Try to derive a formula to get random number from the range [A,B], it should be obvious.
 How this program works if you remove the exit call in child code (right after child_work call)?
 Ad:Child process after exiting the child_work will continue back into forking loop! It will start it's own children. Grandchildren can start their children and so on. To mess it up a bit more child processes do not wait for their children.
@@ -80,4 +262,10 @@ What sleep returns? Should we react to this value somehow?
 Ad:It returns the time left to sleep at the moment of interruption bu signal handling function. In this code child processes does not receive nor handle the signals so this interruption is not possible. In other codes it may be vital to restart sleep with remaining time.
 In the next stage child waiting and child counting will be added. How can we know how many child processes have exited?
 Ad:SIGCHLD counting will not be precise as signals can marge, the only sure method is to count successful calls to wait or waitpid.
+"13 n k [retries]" runs the same n jobs under a supervisor that keeps at most k of them running, a new child is forked as soon as one exits. A job that fails (non zero exit status or killed, try kill on one of the children) is restarted up to retries times, after 100 ms, 200 ms, 400 ms ... Every job end is reported with its run time, the summary gives jobs/s, mean run time and mean latency (from the start of the supervisor, when all jobs are submitted, to the final end of a job, so the wait for a free slot counts).
+"13 -b n k" compares the makespan of all n jobs at once with at most k (and 1, 2, 4, 8) for CPU bound jobs of 50 to 100 ms.
+Why does the supervisor block SIGCHLD instead of handling it?
+Ad:A blocked SIGCHLD stays pending, sigtimedwait returns as soon as a child exits, even if it exited before the call, and the timeout wakes the supervisor when a backoff ends. SIGCHLD is only a wake up, children are still counted with waitpid in a loop as signals merge.
+Why can all at once be slower than k at once?
+Ad:Above the number of CPUs the jobs only share the CPUs, every job stays in the system longer (latency), caches are shared by more processes and memory use grows with n. With sleeping jobs (child_work) there is nothing to share, the limit only makes it slower.
 */
\ No newline at end of file
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/wait.h>
@@ -5,12 +6,16 @@
 #include <errno.h>
 #include <string.h>
 #include <time.h>
+#include "../perfregions.h"
+#include "../prng.h"
+#include "../asynclog.h"
 
 #define ERR(source) (fprintf(stderr,"%s:%d\n",__FILE__,__LINE__),\
                      perror(source),kill(0,SIGKILL),\
 		     		     exit(EXIT_FAILURE))
 
 volatile sig_atomic_t last_signal = 0;
+prng_t rng;
 
 void sethandler( void (*f)(int), int sigNo) {
 	struct sigaction act;
@@ -20,7 +25,7 @@ void sethandler( void (*f)(int), int sigNo) {
 }
 
 void sig_handler(int sig) {
-	printf("[%d] received signal %d\n", getpid(), sig);
+	alog("[%d] received signal %d\n", getpid(), sig);
 	last_signal = sig;
 }
 
@@ -38,14 +43,16 @@ void sigchld_handler(int sig) {
 
 void child_work(int l) {
 	int t,tt;
-	srand(getpid());
-	t = rand()%6+5; 
+	t = prng_below(&rng,6)+5;
+	perfMark_t mark;
 	while(l-- > 0){
+		perf_begin(&mark,"child_sleep");
 		for(tt=t;tt>0;tt=sleep(tt));
-		if (last_signal == SIGUSR1) printf("Success [%d]\n", getpid());
-		else printf("Failed [%d]\n", getpid());
+		perf_end(&mark);
+		if (last_signal == SIGUSR1) alog("Success [%d]\n", getpid());
+		else alog("Failed [%d]\n", getpid());
 	}
-	printf("[%d] Terminates \n",getpid());
+	alog("[%d] Terminates \n",getpid());
 }
 
 
@@ -54,25 +61,32 @@ void parent_work(int k, int p, int l) {
 	struct timespec tp = {p, 0};
 	sethandler(sig_handler,SIGALRM);
 	alarm(l*10);
+	perfMark_t mark;
 	while(last_signal!=SIGALRM) {
 		nanosleep(&tk,NULL);
+		perf_begin(&mark,"parent_kill");
 		if (kill(0, SIGUSR1)<0)ERR("kill");
+		perf_end(&mark);
 		nanosleep(&tp,NULL);
+		perf_begin(&mark,"parent_kill");
 		if (kill(0, SIGUSR2)<0)ERR("kill");
+		perf_end(&mark);
 	}
-	printf("[PARENT] Terminates \n");
+	alog("[PARENT] Terminates \n");
 }
 
 void create_children(int n, int l) {
 	while (n-->0) {
 		switch (fork()) {
-			case 0: sethandler(sig_handler,SIGUSR1);
+			case 0: alog_child();
+				sethandler(sig_handler,SIGUSR1);
 				sethandler(sig_handler,SIGUSR2);
 				child_work(l);
 				exit(EXIT_SUCCESS);
 			case -1:perror("Fork:");
 				exit(EXIT_FAILURE);
 		}
+		prng_jump(&rng);
 	}
 }
 
@@ -90,6 +104,9 @@ int main(int argc, char** argv) {
 	if(argc!=5) usage();
 	n = atoi(argv[1]); k = atoi(argv[2]); p = atoi(argv[3]); l = atoi(argv[4]);
 	if (n<=0 || k<=0 || p<=0 || l<=0)  usage(); 
+	perf_init();
+	if(alog_init(STDOUT_FILENO)) ERR("alog_init");
+	prng_seed(&rng,prng_master());
 	sethandler(sigchld_handler,SIGCHLD);
 	sethandler(SIG_IGN,SIGUSR1);
 	sethandler(SIG_IGN,SIGUSR2);
@@ -119,4 +136,6 @@ Would shifting the setup of SIGCHLD handler past the fork change the program?
 Ad:If one of offspring "dies" very quickly (before parent sets its SIGCHLD handler) it will be a zombi until another offspring terminates. It is not a mayor mistake but it's worth attention.
 Is wait call at the end of parent really needed? Parent waits long enough for children to finish, right?
 Ad:Calculated time may not suffice, in overloaded system expect lags of any duration (few seconds and more), without "wait" children can terminate after the parent because of those lags.
+Why was printf in sig_handler a bug?
+Ad:printf is not async-signal-safe, it takes the stdio lock and changes the buffer. If the signal comes while the child is inside printf in child_work, the handler calls printf on the same stream and the program may deadlock or garble the buffer. The messages now go through alog (../asynclog.h), it only formats into a lock-free ring and a background thread of every process writes them out, so it may be called from the handler.
 */
\ No newline at end of file
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/wait.h>
@@ -5,6 +6,9 @@
 #include <errno.h>
 #include <string.h>
 #include <time.h>
+#include "pacing.h"
+#include "../perfregions.h"
+#include "../asynclog.h"
 
 #define ERR(source) (fprintf(stderr,"%s:%d\n",__FILE__,__LINE__),\
                      perror(source),kill(0,SIGKILL),\
@@ -35,18 +39,22 @@ void sigchld_handler(int sig) {
 	}
 }
 
-void child_work(int m, int p) {
+void child_work(int m, int p, int rt) {
 	int count=0;
-	struct timespec t = {0, m*10000};
+	pacer_t pacer;
+	perfMark_t mark;
+	pacer_init(&pacer, m*10000L, rt);
 	while(1){
 		for(int i =0; i<p; i++){
-			nanosleep(&t,NULL);
+			pacer_wait(&pacer);
+			perf_begin(&mark,"child_kill");
 			if(kill(getppid(),SIGUSR1))ERR("kill");
+			perf_end(&mark);
 		}
-		nanosleep(&t,NULL);
+		pacer_wait(&pacer);
 		if(kill(getppid(),SIGUSR2))ERR("kill");
 		count++;
-		printf("[%d] sent %d SIGUSR2\n",getpid(), count);
+		alog("[%d] sent %d SIGUSR2\n",getpid(), count);
 
 	}
 }
@@ -54,28 +62,38 @@ void child_work(int m, int p) {
 
 void parent_work(sigset_t oldmask) {
 	int count=0;
+	perfMark_t mark;
 	while(1){
 		last_signal=0;
+		perf_begin(&mark,"parent_sigsuspend");
 		while(last_signal!=SIGUSR2)
 			sigsuspend(&oldmask);
+		perf_end(&mark);
 		count++;
-		printf("[PARENT] received %d SIGUSR2\n", count);
+		alog("[PARENT] received %d SIGUSR2\n", count);
 		
 	}
 }
 
 void usage(char *name){
-	fprintf(stderr,"USAGE: %s m  p\n",name);
+	fprintf(stderr,"USAGE: %s m  p [rt]\n",name);
 	fprintf(stderr,"m - number of 1/1000 milliseconds between signals [1,999], i.e. one milisecond maximum\n");
 	fprintf(stderr,"p - after p SIGUSR1 send one SIGUSER2  [1,999]\n");
+	fprintf(stderr,"rt - pace the child with SCHED_FIFO if permitted\n");
 	exit(EXIT_FAILURE);
 }
 
 int main(int argc, char** argv) {
-	int m,p;
-	if(argc!=3) usage(argv[0]);
+	int m,p,rt=0;
+	if(argc!=3&&argc!=4) usage(argv[0]);
+	if(argc==4){
+		if(strcmp(argv[3],"rt")) usage(argv[0]);
+		rt=1;
+	}
 	m = atoi(argv[1]); p = atoi(argv[2]);
 	if (m<=0 || m>999 || p<=0 || p>999)  usage(argv[0]); 
+	perf_init();
+	if(alog_init(STDOUT_FILENO)) ERR("alog_init");
 	sethandler(sigchld_handler,SIGCHLD);
 	sethandler(sig_handler,SIGUSR1);
 	sethandler(sig_handler,SIGUSR2);
@@ -86,7 +104,10 @@ int main(int argc, char** argv) {
 	sigprocmask(SIG_BLOCK, &mask, &oldmask);
 	pid_t pid;
 	if((pid=fork())<0) ERR("fork");
-	if(0==pid) child_work(m,p);
+	if(0==pid) {
+		alog_child();
+		child_work(m,p,rt);
+	}
 	else {
 		parent_work(oldmask);
 		while(wait(NULL)>0);
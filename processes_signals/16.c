@@ -8,10 +8,47 @@
 #include <errno.h>
 #include <string.h>
 #include <time.h>
+#include <limits.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <signal.h>
+#include "pacing.h"
+#include "crc32c.h"
+#include "../arena.h"
+#include "../perfregions.h"
+#include "../asynclog.h"
 
 #define ERR(source) (fprintf(stderr,"%s:%d\n",__FILE__,__LINE__),\
                      perror(source),kill(0,SIGKILL),\
 		     		     exit(EXIT_FAILURE))
+#define MANIFEST_LINE 64
+#define ELAPSED_MS(t0,t1) ((((t1).tv_sec-(t0).tv_sec)+((t1).tv_nsec-(t0).tv_nsec)*1e-9)*1e3)
+
+/* checksum of one block, computed by a helper thread while the block is written */
+typedef struct sumJob {
+	pthread_t tid;
+	char *buf;
+	size_t len;
+	uint32_t crc;
+	double ms;
+} sumJob_t;
+
+typedef struct manifestEntry {
+	off_t offset;
+	ssize_t len;
+	uint32_t crc;
+} manifestEntry_t;
+
+typedef struct verifyJob {
+	pthread_t tid;
+	int fd;
+	char *buf;
+	manifestEntry_t *entries;
+	int count;
+	int *next;
+	int bad;
+	long bytes;
+} verifyJob_t;
 
 volatile sig_atomic_t sig_count = 0;
 
@@ -26,12 +63,16 @@ void sig_handler(int sig) {
 	sig_count++;;
 }
 
-void child_work(int m) {
-	struct timespec t = {0, m*10000};
+void child_work(int m, int rt) {
+	pacer_t pacer;
+	perfMark_t mark;
 	sethandler(SIG_DFL,SIGUSR1);
+	pacer_init(&pacer, m*10000L, rt);
 	while(1){
-		nanosleep(&t,NULL);
+		pacer_wait(&pacer);
+		perf_begin(&mark,"child_kill");
 		if(kill(getppid(),SIGUSR1))ERR("kill");
+		perf_end(&mark);
 	}
 }
 
@@ -63,45 +104,295 @@ ssize_t bulk_write(int fd, char *buf, size_t count){
 	return len ;
 }
 
-void parent_work(int b, int s, char *name) {
+ssize_t bulk_pread(int fd, char *buf, size_t count, off_t offset){
+	ssize_t c;
+	ssize_t len=0;
+	do{
+		c=TEMP_FAILURE_RETRY(pread(fd,buf,count,offset));
+		if(c<0) return c;
+		if(c==0) return len; //EOF
+		buf+=c;
+		len+=c;
+		count-=c;
+		offset+=c;
+	}while(count>0);
+	return len ;
+}
+
+ssize_t bulk_pwrite(int fd, char *buf, size_t count, off_t offset){
+	ssize_t c;
+	ssize_t len=0;
+	do{
+		c=TEMP_FAILURE_RETRY(pwrite(fd,buf,count,offset));
+		if(c<0) return c;
+		buf+=c;
+		len+=c;
+		count-=c;
+		offset+=c;
+	}while(count>0);
+	return len ;
+}
+
+/* Write-behind: writeback of a block is started right after it is written and waited for
+ * one block later, then its pages are dropped, so dirty memory never exceeds two blocks */
+void flush_block(int out, off_t offset, off_t count, int wait){
+	if(count<=0) return;
+	if(!wait){
+		if(TEMP_FAILURE_RETRY(sync_file_range(out,offset,count,SYNC_FILE_RANGE_WRITE)))ERR("sync_file_range");
+		return;
+	}
+	if(TEMP_FAILURE_RETRY(sync_file_range(out,offset,count,SYNC_FILE_RANGE_WAIT_BEFORE|SYNC_FILE_RANGE_WRITE|SYNC_FILE_RANGE_WAIT_AFTER)))
+		ERR("sync_file_range");
+	if(posix_fadvise(out,offset,count,POSIX_FADV_DONTNEED))ERR("posix_fadvise");
+}
+
+void *sum_block(void *arg){
+	sumJob_t *job=arg;
+	struct timespec t0,t1;
+	perfMark_t mark;
+	if(clock_gettime(CLOCK_MONOTONIC,&t0))ERR("clock_gettime");
+	perf_begin(&mark,"checksum");
+	job->crc=crc32c(0,job->buf,job->len);
+	perf_end(&mark);
+	if(clock_gettime(CLOCK_MONOTONIC,&t1))ERR("clock_gettime");
+	job->ms=ELAPSED_MS(t0,t1);
+	return NULL;
+}
+
+/* SIGUSR1 stays blocked in the helper, the parent thread alone counts the signals */
+void start_sum(sumJob_t *job, char *buf, size_t len){
+	sigset_t mask,old;
+	job->buf=buf;
+	job->len=len;
+	sigemptyset(&mask);
+	sigaddset(&mask,SIGUSR1);
+	if(pthread_sigmask(SIG_BLOCK,&mask,&old))ERR("pthread_sigmask");
+	if(pthread_create(&job->tid,NULL,sum_block,job))ERR("pthread_create");
+	if(pthread_sigmask(SIG_SETMASK,&old,NULL))ERR("pthread_sigmask");
+}
+
+/* name.crc: header line, then block number, offset, length and CRC32C of every block */
+void write_manifest(char *name, int b, int s, manifestEntry_t *entries){
+	char path[PATH_MAX],*text;
+	int fd;
+	size_t len;
+	if(snprintf(path,PATH_MAX,"%s.crc",name)>=PATH_MAX) ERR("manifest name");
+	if(NULL==(text=malloc((size_t)(b+1)*MANIFEST_LINE))) ERR("malloc");
+	len=snprintf(text,MANIFEST_LINE,"crc32c %d %d\n",b,s);
+	for(int i=0;i<b;i++)
+		len+=snprintf(text+len,MANIFEST_LINE,"%d %ld %ld %08x\n",i,(long)entries[i].offset,(long)entries[i].len,entries[i].crc);
+	if((fd=TEMP_FAILURE_RETRY(open(path,O_WRONLY|O_CREAT|O_TRUNC,0666)))<0)ERR("open");
+	if(bulk_write(fd,text,len)<0) ERR("write");
+	if(TEMP_FAILURE_RETRY(close(fd)))ERR("close");
+	free(text);
+}
+
+void parent_work(int b, int s, char *name, int wb, int sum) {
 	int i,in,out;
 	ssize_t count;
-	char *buf=malloc(s);
-	if(!buf) ERR("malloc");
-	if((out=TEMP_FAILURE_RETRY(open(name,O_WRONLY|O_CREAT|O_TRUNC|O_APPEND,0777)))<0)ERR("open");
+	off_t offset=0,prev=0;
+	struct timespec t0,t1;
+	arena_t arena;
+	struct timespec start,first;
+	perfMark_t mark;
+	char *buf;
+	sumJob_t job;
+	manifestEntry_t *entries=NULL;
+	double sumMs=0,waitMs=0;
+	if(clock_gettime(CLOCK_MONOTONIC,&start))ERR("clock_gettime");
+	if(sum){
+		crc32c_init();
+		if(NULL==(entries=malloc(sizeof(manifestEntry_t)*b))) ERR("malloc");
+	}
+	if(arena_init(&arena,s,1,0,0))ERR("arena_init");
+	if(NULL==(buf=arena_alloc(&arena))) ERR("arena_alloc");
+	if((out=TEMP_FAILURE_RETRY(open(name,O_WRONLY|O_CREAT|O_TRUNC|(wb?0:O_APPEND),0777)))<0)ERR("open");
+	if(wb&&TEMP_FAILURE_RETRY(fallocate(out,0,0,(off_t)b*s))){
+		if(errno!=EOPNOTSUPP) ERR("fallocate");
+		fprintf(stderr,"fallocate not supported, writing without preallocation\n");
+	}
 	if((in=TEMP_FAILURE_RETRY(open("/dev/urandom",O_RDONLY)))<0)ERR("open");
 	for(i=0; i<b;i++){
+		if(clock_gettime(CLOCK_MONOTONIC,&t0))ERR("clock_gettime");
+		perf_begin(&mark,"read_block");
 		if((count=bulk_read(in,buf,s))<0) ERR("read");
-		if((count=bulk_write(out,buf,count))<0) ERR("read");
-		if(TEMP_FAILURE_RETRY(fprintf(stderr,"Block of %ld bytes transfered. Signals RX:%d\n",count,sig_count))<0)ERR("fprintf");;
+		perf_end(&mark);
+		if(sum) start_sum(&job,buf,count);
+		perf_begin(&mark,"write_block");
+		if(wb) count=bulk_pwrite(out,buf,count,offset);
+		else count=bulk_write(out,buf,count);
+		if(count<0) ERR("write");
+		perf_end(&mark);
+		if(sum){
+			struct timespec w0,w1;
+			if(clock_gettime(CLOCK_MONOTONIC,&w0))ERR("clock_gettime");
+			if(pthread_join(job.tid,NULL))ERR("pthread_join");
+			if(clock_gettime(CLOCK_MONOTONIC,&w1))ERR("clock_gettime");
+			waitMs+=ELAPSED_MS(w0,w1);
+			sumMs+=job.ms;
+			entries[i].offset=offset;
+			entries[i].len=count;
+			entries[i].crc=job.crc;
+		}
+		if(wb){
+			flush_block(out,offset,count,0);
+			flush_block(out,prev,offset-prev,1);
+			prev=offset;
+		}
+		offset+=count;
+		if(clock_gettime(CLOCK_MONOTONIC,&t1))ERR("clock_gettime");
+		if(0==i&&clock_gettime(CLOCK_MONOTONIC,&first))ERR("clock_gettime");
+		alog("Block of %ld bytes transfered in %.1f ms. Signals RX:%d\n",count,
+			((t1.tv_sec-t0.tv_sec)+(t1.tv_nsec-t0.tv_nsec)*1e-9)*1e3,sig_count);
+	}
+	if(wb){
+		flush_block(out,prev,offset-prev,1);
+		if(TEMP_FAILURE_RETRY(ftruncate(out,offset)))ERR("ftruncate");
 	}
 	if(TEMP_FAILURE_RETRY(close(in)))ERR("close");
 	if(TEMP_FAILURE_RETRY(close(out)))ERR("close");
-	free(buf);
+	if(clock_gettime(CLOCK_MONOTONIC,&t1))ERR("clock_gettime");
+	alog_flush();
+	fprintf(stderr,"%ld bytes in %.3f s, %.1f MB/s\n",(long)offset,ELAPSED_MS(start,t1)*1e-3,offset/ELAPSED_MS(start,t1)*1e3/(1024*1024));
+	if(sum){
+		write_manifest(name,b,s,entries);
+		fprintf(stderr,"crc32c (%s): %.1f ms computing, %.1f ms (%.1f%%) not hidden behind writes, manifest %s.crc\n",
+			crc32c_impl(),sumMs,waitMs,100*waitMs/ELAPSED_MS(start,t1),name);
+		free(entries);
+	}
+	arena_stats(&arena,stderr);
+	fprintf(stderr,"First block written after %.3f ms\n",((first.tv_sec-start.tv_sec)+(first.tv_nsec-start.tv_nsec)*1e-9)*1e3);
+	arena_free(&arena,buf);
+	arena_destroy(&arena);
 	if(kill(0,SIGUSR1))ERR("kill");
 }
 
+void *verify_blocks(void *arg){
+	verifyJob_t *job=arg;
+	manifestEntry_t *e;
+	ssize_t count;
+	uint32_t crc;
+	int i;
+	while((i=__atomic_fetch_add(job->next,1,__ATOMIC_RELAXED))<job->count){
+		e=&job->entries[i];
+		if((count=bulk_pread(job->fd,job->buf,e->len,e->offset))<0) ERR("pread");
+		crc=crc32c(0,job->buf,count);
+		job->bytes+=count;
+		if(count!=e->len||crc!=e->crc){
+			fprintf(stderr,"Block %d at offset %ld: %ld bytes crc32c %08x, expected %ld bytes %08x\n",i,(long)e->offset,(long)count,crc,(long)e->len,e->crc);
+			job->bad++;
+		}
+	}
+	return NULL;
+}
+
+/* Checks name against name.crc, blocks are handed out to the threads one at a time */
+int verify(char *name, int threads){
+	char path[PATH_MAX],*text,*line,*save;
+	manifestEntry_t *entries;
+	verifyJob_t *jobs;
+	arena_t arena;
+	struct stat st;
+	struct timespec t0,t1;
+	int fd,mfd,b,s,i,next=0,bad=0;
+	long bytes=0;
+	crc32c_init();
+	if(snprintf(path,PATH_MAX,"%s.crc",name)>=PATH_MAX) ERR("manifest name");
+	if((mfd=TEMP_FAILURE_RETRY(open(path,O_RDONLY)))<0)ERR("open manifest");
+	if(fstat(mfd,&st))ERR("fstat");
+	if(NULL==(text=malloc(st.st_size+1))) ERR("malloc");
+	if(bulk_read(mfd,text,st.st_size)!=st.st_size) ERR("read manifest");
+	text[st.st_size]=0;
+	if(TEMP_FAILURE_RETRY(close(mfd)))ERR("close");
+	if(NULL==(line=strtok_r(text,"\n",&save))||2!=sscanf(line,"crc32c %d %d",&b,&s)||b<=0||s<=0){
+		fprintf(stderr,"%s: not a crc32c manifest\n",path);
+		exit(EXIT_FAILURE);
+	}
+	if(NULL==(entries=malloc(sizeof(manifestEntry_t)*b))) ERR("malloc");
+	for(i=0;i<b&&NULL!=(line=strtok_r(NULL,"\n",&save));i++){
+		long offset,len;
+		int n;
+		if(4!=sscanf(line,"%d %ld %ld %x",&n,&offset,&len,&entries[i].crc)||n!=i||len<0||len>s){
+			fprintf(stderr,"%s: bad line %d\n",path,i+2);
+			exit(EXIT_FAILURE);
+		}
+		entries[i].offset=offset;
+		entries[i].len=len;
+	}
+	free(text);
+	if(i<b){
+		fprintf(stderr,"%s: %d of %d blocks listed\n",path,i,b);
+		exit(EXIT_FAILURE);
+	}
+	if((fd=TEMP_FAILURE_RETRY(open(name,O_RDONLY)))<0)ERR("open");
+	if(arena_init(&arena,s,threads,0,0))ERR("arena_init");
+	if(NULL==(jobs=calloc(threads,sizeof(verifyJob_t)))) ERR("calloc");
+	if(clock_gettime(CLOCK_MONOTONIC,&t0))ERR("clock_gettime");
+	for(i=0;i<threads;i++){
+		jobs[i].fd=fd;
+		jobs[i].buf=arena_alloc(&arena);
+		jobs[i].entries=entries;
+		jobs[i].count=b;
+		jobs[i].next=&next;
+		if(pthread_create(&jobs[i].tid,NULL,verify_blocks,&jobs[i]))ERR("pthread_create");
+	}
+	for(i=0;i<threads;i++){
+		if(pthread_join(jobs[i].tid,NULL))ERR("pthread_join");
+		bad+=jobs[i].bad;
+		bytes+=jobs[i].bytes;
+		arena_free(&arena,jobs[i].buf);
+	}
+	if(clock_gettime(CLOCK_MONOTONIC,&t1))ERR("clock_gettime");
+	fprintf(stderr,"%d blocks, %ld bytes verified by %d threads (crc32c %s) in %.3f s, %.1f MB/s, %d bad\n",b,bytes,threads,
+		crc32c_impl(),ELAPSED_MS(t0,t1)*1e-3,bytes/ELAPSED_MS(t0,t1)*1e3/(1024*1024),bad);
+	if(TEMP_FAILURE_RETRY(close(fd)))ERR("close");
+	arena_destroy(&arena);
+	free(jobs);
+	free(entries);
+	return bad?EXIT_FAILURE:EXIT_SUCCESS;
+}
+
 void usage(char *name){
-	fprintf(stderr,"USAGE: %s m b s \n",name);
+	fprintf(stderr,"USAGE: %s m b s name [rt] [wb] [sum]\n",name);
+	fprintf(stderr,"       %s --verify name [threads]\n",name);
 	fprintf(stderr,"m - number of 1/1000 milliseconds between signals [1,999], i.e. one milisecond maximum\n");
 	fprintf(stderr,"b - number of blocks [1,999]\n");
 	fprintf(stderr,"s - size of of blocks [1,999] in MB\n");
 	fprintf(stderr,"name of the output file\n");
+	fprintf(stderr,"rt - pace the child with SCHED_FIFO if permitted\n");
+	fprintf(stderr,"wb - preallocate the output and flush every block behind the writer\n");
+	fprintf(stderr,"sum - CRC32C of every block into the manifest name.crc\n");
+	fprintf(stderr,"--verify - check name against name.crc with threads threads [1,64], all CPUs by default\n");
 	exit(EXIT_FAILURE);
 }
 
 int main(int argc, char** argv) {
-	int m,b,s;
+	int m,b,s,rt=0,wb=0,sum=0;
 	char *name;
-	if(argc!=5) usage(argv[0]);
+	if(argc>=3&&!strcmp(argv[1],"--verify")){
+		int threads=sysconf(_SC_NPROCESSORS_ONLN);
+		if(argc>4) usage(argv[0]);
+		if(4==argc) threads=atoi(argv[3]);
+		if(threads<=0||threads>64) usage(argv[0]);
+		return verify(argv[2],threads);
+	}
+	if(argc<5||argc>8) usage(argv[0]);
+	for(int i=5;i<argc;i++){
+		if(!strcmp(argv[i],"rt")) rt=1;
+		else if(!strcmp(argv[i],"wb")) wb=1;
+		else if(!strcmp(argv[i],"sum")) sum=1;
+		else usage(argv[0]);
+	}
 	m = atoi(argv[1]); b = atoi(argv[2]);  s = atoi(argv[3]); name=argv[4];
 	if (m<=0||m>999||b<=0||b>999||s<=0||s>999)usage(argv[0]); 
+	perf_init();
 	sethandler(sig_handler,SIGUSR1);
 	pid_t pid;
 	if((pid=fork())<0) ERR("fork");
-	if(0==pid) child_work(m);
+	if(0==pid) child_work(m,rt);
 	else {
-		parent_work(b,s*1024*1024,name);
+		if(alog_init(STDERR_FILENO)) ERR("alog_init");
+		parent_work(b,s*1024*1024,name,wb,sum);
 		while(wait(NULL)>0);
 	}
 	return EXIT_SUCCESS;
@@ -130,4 +421,9 @@ It is hard to reuse a code depending on SA_RESTART flag, it can only be transfer
 Sometimes you wish to know about interruption ASAP to react quickly. Sigsuspend would not work if you use this flag!
 Why do we not react on other (apart from EINTR) errors of fprintf? If program can not write on stderr (most likely screen) then it cannot report errors.
 Really big (f)printfs can get interrupted in the middle of the process (like write). Then it is difficult to restart the process especially if formatting is complicated. Avoid using printf where restarting would be critical (most cases except for the screen output) and the volume of transferred data is significant, use write instead.
-*/
\ No newline at end of file
+The child paces signals with pacing.h (absolute deadlines), it prints the achieved rate and lateness histogram every second, compare it with the number of signals counted by the parent.
+The block buffer comes from the arena (../arena.h) backed by huge pages when available, run with ARENA_NOHUGE=1 to compare page faults and time to the first block.
+With the wb argument the output is preallocated with fallocate and written with pwrite at known offsets, every block is pushed to disk with sync_file_range as soon as it is written and dropped from page cache with posix_fadvise one block later. Without it dirty pages pile up until the kernel throttles the writer, compare the per block times of both modes on blocks larger than the dirty limit.
+With the sum argument every block gets a CRC32C (crc32c.h, the crc32 instruction of SSE4.2 when the CPU has it) computed by a helper thread while the parent writes the same buffer, the parent joins it only after the write, the time it still waits there is the part of the checksum not hidden behind I/O. Digests go to the sidecar manifest name.crc, "--verify name [threads]" reads the file back in parallel and reports every block that does not match. Compare the MB/s line of runs with and without sum to see the overhead.
+The per block line is logged with alog (../asynclog.h): formatted into a lock-free ring and written by a background thread in large writes, the fprintf to stderr (one unbuffered write per line, restarted on EINTR) is no longer a part of the timed loop. Run with ALOG_SYNC=1 to write every line at once and compare, ALOG_RATE=n keeps at most n lines per second.
+*/
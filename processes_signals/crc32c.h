@@ -0,0 +1,70 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+/*
+CRC32C (Castagnoli polynomial, as in iSCSI, ext4 and btrfs) of a buffer, used by the checksum stage of 16.c.
+On x86-64 CPUs with SSE4.2 the crc32 instruction handles 8 bytes per step, elsewhere a slicing-by-8 table handles 8 bytes with 8 lookups. crc32c_init picks the implementation once, call it before the first crc32c.
+crc32c(0, buf, len) is the checksum of buf, crc32c(previous, next, len) continues it over the next part.
+*/
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#define CRC32C_POLY 0x82f63b78U
+
+static uint32_t crc32cTable[8][256];
+static int crc32cHardware;
+
+static void crc32c_init(void) {
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t c = i;
+		for (int k = 0; k < 8; k++) c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+		crc32cTable[0][i] = c;
+	}
+	for (int t = 1; t < 8; t++)
+		for (int i = 0; i < 256; i++)
+			crc32cTable[t][i] = (crc32cTable[t - 1][i] >> 8) ^ crc32cTable[0][crc32cTable[t - 1][i] & 0xff];
+#if defined(__x86_64__)
+	crc32cHardware = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+static uint32_t crc32c_soft(uint32_t crc, const unsigned char *p, size_t len) {
+	uint64_t w;
+	for (; len >= 8; p += 8, len -= 8) {
+		memcpy(&w, p, 8);
+		w ^= crc;
+		crc = crc32cTable[7][w & 0xff] ^ crc32cTable[6][(w >> 8) & 0xff] ^ crc32cTable[5][(w >> 16) & 0xff] ^
+			crc32cTable[4][(w >> 24) & 0xff] ^ crc32cTable[3][(w >> 32) & 0xff] ^ crc32cTable[2][(w >> 40) & 0xff] ^
+			crc32cTable[1][(w >> 48) & 0xff] ^ crc32cTable[0][w >> 56];
+	}
+	while (len--) crc = (crc >> 8) ^ crc32cTable[0][(crc ^ *p++) & 0xff];
+	return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hard(uint32_t crc, const unsigned char *p, size_t len) {
+	uint64_t c = crc, w;
+	for (; len >= 8; p += 8, len -= 8) {
+		memcpy(&w, p, 8);
+		c = __builtin_ia32_crc32di(c, w);
+	}
+	crc = c;
+	while (len--) crc = __builtin_ia32_crc32qi(crc, *p++);
+	return crc;
+}
+#endif
+
+static uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+	crc = ~crc;
+#if defined(__x86_64__)
+	if (crc32cHardware) return ~crc32c_hard(crc, buf, len);
+#endif
+	return ~crc32c_soft(crc, buf, len);
+}
+
+static const char *crc32c_impl(void) {
+	return crc32cHardware ? "sse4.2" : "slicing-by-8";
+}
+
+#endif
@@ -0,0 +1,98 @@
+#ifndef PACING_H
+#define PACING_H
+/*
+Signal pacing on absolute CLOCK_MONOTONIC deadlines, used by child_work in 15.c and 16.c.
+Relative nanosleep adds the cost of the syscall, of the kill call and of the wakeup to every interval, the error accumulates and the real rate falls below the requested one. With absolute deadlines (TIMER_ABSTIME) the next deadline is always previous deadline plus interval, late wakeups do not move the schedule.
+Intervals shorter than PACE_SPIN_THRESHOLD are close to the usual wakeup latency, for them the pacer sleeps while more than PACE_SPIN_MARGIN is left to the deadline and spins on clock_gettime for the rest. An interval not longer than the margin (10us, "15 1 ...") never sleeps, it is a pure spin, SCHED_FIFO is refused for it so the spinning child can not starve the parent on its CPU.
+*/
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+
+#define PACE_SPIN_THRESHOLD 50000L
+#define PACE_SPIN_MARGIN 10000L
+#define PACE_BUCKETS 16
+#define PACE_REPORT_NS 1000000000L
+#define NSEC(ts) ((long long)(ts).tv_sec*1000000000LL+(ts).tv_nsec)
+
+typedef struct pacer {
+	long interval;
+	long long next;
+	long long start;
+	long ticks;
+	long missed;
+	long long maxlate;
+	long hist[PACE_BUCKETS];
+} pacer_t;
+
+static long long pacer_now(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return NSEC(t);
+}
+
+static void pacer_reset(pacer_t *p, long long now) {
+	p->start = now;
+	p->ticks = p->missed = 0;
+	p->maxlate = 0;
+	for (int i = 0; i < PACE_BUCKETS; i++) p->hist[i] = 0;
+}
+
+/* rt asks for SCHED_FIFO, without the privilege the pacer goes on with the default policy */
+static void pacer_init(pacer_t *p, long interval, int rt) {
+	p->interval = interval;
+	prctl(PR_SET_TIMERSLACK, 1UL);
+	if (rt && interval <= PACE_SPIN_MARGIN)
+		fprintf(stderr, "[%d] interval of %ldns only spins, SCHED_FIFO refused, using default policy\n", getpid(), interval);
+	else if (rt) {
+		struct sched_param param = { .sched_priority = 1 };
+		if (sched_setscheduler(0, SCHED_FIFO, &param))
+			fprintf(stderr, "[%d] SCHED_FIFO not permitted, using default policy\n", getpid());
+	}
+	pacer_reset(p, pacer_now());
+	p->next = p->start;
+}
+
+/* lateness histogram, bucket 0 is below 1us, bucket i below 2^i us, the last one is open */
+static void pacer_report(pacer_t *p, long long now) {
+	double elapsed = (now - p->start) * 1e-9;
+	fprintf(stderr, "[%d] pacing: requested %.0f/s achieved %.0f/s, missed %ld, max late %.1fus\n[%d] late:",
+		getpid(), 1e9 / p->interval, p->ticks / elapsed, p->missed, p->maxlate * 1e-3, getpid());
+	for (int i = 0; i < PACE_BUCKETS; i++)
+		if (p->hist[i]) fprintf(stderr, " %s%ldus:%ld", i == PACE_BUCKETS - 1 ? ">=" : "<",
+			i == PACE_BUCKETS - 1 ? 1L << (i - 1) : 1L << i, p->hist[i]);
+	fprintf(stderr, "\n");
+}
+
+/* Waits for the next deadline. When the caller falls behind by more than one interval
+ * the missed ticks are counted and the schedule restarts from now instead of bursting. */
+static void pacer_wait(pacer_t *p) {
+	struct timespec deadline;
+	long long now, late, wake;
+	p->next += p->interval;
+	wake = p->interval < PACE_SPIN_THRESHOLD ? p->next - PACE_SPIN_MARGIN : p->next;
+	deadline.tv_sec = wake / 1000000000LL;
+	deadline.tv_nsec = wake % 1000000000LL;
+	if (wake > pacer_now())
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR);
+	while ((now = pacer_now()) < p->next);
+	late = now - p->next;
+	if (late > p->maxlate) p->maxlate = late;
+	int bucket = 0;
+	for (long long us = late / 1000; us > 0 && bucket < PACE_BUCKETS - 1; us >>= 1) bucket++;
+	p->hist[bucket]++;
+	p->ticks++;
+	if (late > p->interval) {
+		p->missed += late / p->interval;
+		p->next = now;
+	}
+	if (now - p->start >= PACE_REPORT_NS) {
+		pacer_report(p, now);
+		pacer_reset(p, now);
+	}
+}
+
+#endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stddef.h>
 #include <pthread.h>
@@ -5,92 +6,476 @@
 #include <stdio.h>
 #include <math.h>
 #include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "affinity.h"
+#include "../perfregions.h"
+#include "../prng.h"
 
 #define MAXLINE 4096
 #define DEFAULT_THREADCOUNT 10
 #define DEFAULT_SAMPLESIZE 100
+#define DEFAULT_SAMPLER SAMPLER_PRNG
+#define SOBOL_BITS 32
+#define BENCH_MAXSAMPLES (1<<30)
+#define PRNG_BATCH 256
+#define SHARD_CHUNK (64*PRNG_BATCH)
+#define ELAPSED(start,end) (((end).tv_sec-(start).tv_sec)+(((end).tv_nsec - (start).tv_nsec) * 1.0e-9))
 
 #define ERR(source) (perror(source),\
 		     fprintf(stderr,"%s:%d\n",__FILE__,__LINE__),\
 		     exit(EXIT_FAILURE))
 
 typedef unsigned int UINT;
+typedef enum sampler { SAMPLER_PRNG, SAMPLER_HALTON, SAMPLER_SOBOL, SAMPLER_COUNT } sampler_t;
+static const char *samplerNames[SAMPLER_COUNT] = { "prng", "halton", "sobol" };
 typedef struct argsEstimation {
 	pthread_t tid;
-	UINT seed;
+	prng_t rng;
+	sampler_t sampler;
+	uint32_t scramble;
+	long firstIndex;
 	int samplesCount;
+	int worker;
+	int reportFd;
 } argsEstimation_t;
+/* Partial hit count of one worker, written to the pipe by shard processes.
+ * The record is smaller than PIPE_BUF, so writes from all threads of all shards are never interleaved. */
+typedef struct shardReport {
+	int worker;
+	int samples;
+	long hits;
+} shardReport_t;
+typedef struct estimate {
+	double pi;
+	double error;
+	long samples;
+} estimate_t;
 
-void ReadArguments(int argc, char **argv, int *threadCount, int *samplesCount);
+void ReadArguments(int argc, char **argv, int *threadCount, int *samplesCount, sampler_t *sampler, double *accuracy, int *scaling, int *procs, int *layouts);
+estimate_t estimate_pi(int threadCount, int samplesCount, sampler_t sampler, uint64_t masterSeed, const cpuPlan_t *plan);
+estimate_t estimate_shards(int procs, int threadCount, int samplesCount, sampler_t sampler, uint64_t masterSeed, const cpuPlan_t *plan);
+argsEstimation_t* start_workers(int firstWorker, int threadCount, int samplesCount, sampler_t sampler, uint64_t masterSeed, const cpuPlan_t *plan, int reportFd);
+void join_workers(argsEstimation_t *estimations, int threadCount, long *hits);
+estimate_t merge_estimate(const long *hits, int workers, int samplesCount);
+void run_shard(int shard, int threadCount, int samplesCount, sampler_t sampler, uint64_t masterSeed, const cpuPlan_t *plan, int fd);
+void layout_benchmark(int workers, int samplesCount, uint64_t masterSeed, const cpuPlan_t *plan);
+void benchmark(int threadCount, double accuracy, uint64_t masterSeed, const cpuPlan_t *plan);
+void scaling_benchmark(int threadCount, int samplesCount, uint64_t masterSeed, const cpuPlan_t *plan);
 void* pi_estimation(void *args);
+long count_samples(argsEstimation_t *args);
+long stream_samples(argsEstimation_t *args);
+long prng_count(argsEstimation_t *args);
+long halton_count(argsEstimation_t *args);
+long sobol_count(argsEstimation_t *args);
 
 int main(int argc, char** argv) {
-	int threadCount, samplesCount;
-	double *subresult;
-	ReadArguments(argc, argv, &threadCount, &samplesCount);
+	int threadCount, samplesCount, scaling, procs, layouts;
+	sampler_t sampler;
+	double accuracy;
+	cpuPlan_t plan;
+	estimate_t result;
+	ReadArguments(argc, argv, &threadCount, &samplesCount, &sampler, &accuracy, &scaling, &procs, &layouts);
+	if (affinity_plan(&plan) < 0) {
+		printf("Invalid value for 'AFFINITY'");
+		exit(EXIT_FAILURE);
+	}
+	perf_init();
+	uint64_t masterSeed = prng_master();
+	if (scaling) {
+		scaling_benchmark(threadCount, samplesCount, masterSeed, &plan);
+		return EXIT_SUCCESS;
+	}
+	if (layouts) {
+		layout_benchmark(threadCount, samplesCount, masterSeed, &plan);
+		return EXIT_SUCCESS;
+	}
+	if (accuracy > 0.0) {
+		benchmark(threadCount, accuracy, masterSeed, &plan);
+		return EXIT_SUCCESS;
+	}
+	if (procs > 0) {
+		result = estimate_shards(procs, threadCount, samplesCount, sampler, masterSeed, &plan);
+		printf("%d shards x %d threads\n", procs, threadCount);
+	} else result = estimate_pi(threadCount, samplesCount, sampler, masterSeed, &plan);
+	printf("PI ~= %f\n", result.pi);
+	printf("%s: %ld samples, estimated error %e, actual error %e\n", samplerNames[sampler],
+		result.samples, result.error, fabs(result.pi - M_PI));
+	return EXIT_SUCCESS;
+}
+
+void ReadArguments(int argc, char **argv, int *threadCount, int *samplesCount, sampler_t *sampler, double *accuracy, int *scaling, int *procs, int *layouts) {
+	*threadCount = DEFAULT_THREADCOUNT;
+	*samplesCount = DEFAULT_SAMPLESIZE;
+	*sampler = DEFAULT_SAMPLER;
+	*accuracy = 0.0;
+	*scaling = 0;
+	*procs = 0;
+	*layouts = 0;
+
+	if (argc >= 2) {
+		*threadCount = atoi(argv[1]);
+		if (*threadCount <= 0) {
+			printf("Invalid value for 'threadCount'");
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (argc >= 3) {
+		*samplesCount = atoi(argv[2]);
+		if (*samplesCount <= 0) {
+			printf("Invalid value for 'samplesCount'");
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (argc >= 4 && !strcmp(argv[3], "scaling")) {
+		*scaling = 1;
+		return;
+	}
+	if (argc >= 4 && !strcmp(argv[3], "layouts")) {
+		*layouts = 1;
+		return;
+	}
+	if (argc >= 4 && !strcmp(argv[3], "--procs")) {
+		*procs = argc >= 5 ? atoi(argv[4]) : 0;
+		if (*procs <= 0) {
+			printf("Invalid value for 'procs'");
+			exit(EXIT_FAILURE);
+		}
+		argv += 2;
+		argc -= 2;
+		if (argc >= 5) {
+			printf("The 'accuracy' benchmark can not be combined with '--procs'");
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (argc >= 4) {
+		for (*sampler = 0; *sampler < SAMPLER_COUNT; (*sampler)++)
+			if (!strcmp(argv[3], samplerNames[*sampler])) break;
+		if (*sampler == SAMPLER_COUNT) {
+			printf("Invalid value for 'sampler' (prng, halton or sobol)");
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (argc >= 5) {
+		*accuracy = atof(argv[4]);
+		if (*accuracy <= 0.0) {
+			printf("Invalid value for 'accuracy'");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+/* Every thread gets a disjoint slice [i*samplesCount, (i+1)*samplesCount) of one sequence,
+ * hits are summed as integers so the result does not depend on the number of threads.
+ * The error is estimated from the spread of per-thread slice estimates (batch means). */
+estimate_t estimate_pi(int threadCount, int samplesCount, sampler_t sampler, uint64_t masterSeed, const cpuPlan_t *plan) {
+	estimate_t result;
+	long *hits = (long*) malloc(sizeof(long) * threadCount);
+	if (hits == NULL) ERR("Malloc error for hit counts!");
+	argsEstimation_t* estimations = start_workers(0, threadCount, samplesCount, sampler, masterSeed, plan, -1);
+	join_workers(estimations, threadCount, hits);
+	result = merge_estimate(hits, threadCount, samplesCount);
+	free(hits);
+	return result;
+}
+
+/* Starts workers firstWorker .. firstWorker+threadCount-1 of the global numbering, worker w gets
+ * the w-th stream split from the master and the slice starting at w*samplesCount. With reportFd >= 0
+ * the workers also stream their partial hit counts to it. */
+argsEstimation_t* start_workers(int firstWorker, int threadCount, int samplesCount, sampler_t sampler, uint64_t masterSeed, const cpuPlan_t *plan, int reportFd) {
+	pthread_attr_t threadAttr;
 	argsEstimation_t* estimations = (argsEstimation_t*) malloc(sizeof(argsEstimation_t) * threadCount);
 	if (estimations == NULL) ERR("Malloc error for estimation arguments!");
-	srand(time(NULL));
+	prng_t master;
+	prng_seed(&master, masterSeed);
+	uint32_t scramble = prng_next(&master) >> 32;
+	for (int w = 0; w < firstWorker; w++) prng_jump(&master);
 	for (int i = 0; i < threadCount; i++) {
-		estimations[i].seed = rand();
+		prng_split(&master, &estimations[i].rng);
+		estimations[i].sampler = sampler;
+		estimations[i].scramble = scramble;
+		estimations[i].worker = firstWorker + i;
+		estimations[i].firstIndex = (long) (firstWorker + i) * samplesCount;
 		estimations[i].samplesCount = samplesCount;
+		estimations[i].reportFd = reportFd;
 	}
 	for (int i = 0; i < threadCount; i++) {
-		int err = pthread_create(&(estimations[i].tid), NULL, pi_estimation, &estimations[i]);
+		if (pthread_attr_init(&threadAttr)) ERR("Couldn't create pthread_attr_t");
+		if (affinity_attr(&threadAttr, plan, firstWorker + i)) ERR("Couldn't set thread affinity");
+		int err = pthread_create(&(estimations[i].tid), &threadAttr, pi_estimation, &estimations[i]);
 		if (err != 0) ERR("Couldn't create thread");
+		pthread_attr_destroy(&threadAttr);
 	}
-	double cumulativeResult = 0.0;
+	return estimations;
+}
+
+void join_workers(argsEstimation_t *estimations, int threadCount, long *hits) {
+	long *subresult;
 	for (int i = 0; i < threadCount; i++) {
 		int err = pthread_join(estimations[i].tid, (void*)&subresult);
 		if (err != 0) ERR("Can't join with a thread");
+		hits[i] = 0;
 		if(NULL!=subresult){
-			cumulativeResult += *subresult;
+			hits[i] = *subresult;
 			free(subresult);
 		}
 	}
-	double result = cumulativeResult / threadCount;
-	printf("PI ~= %f\n", result);
 	free(estimations);
 }
 
-void ReadArguments(int argc, char **argv, int *threadCount, int *samplesCount) {
-	*threadCount = DEFAULT_THREADCOUNT;
-	*samplesCount = DEFAULT_SAMPLESIZE;
+/* Hit counts are merged in worker order, the same workers give the same estimate
+ * whether they ran as threads of one process or spread over shard processes */
+estimate_t merge_estimate(const long *hits, int workers, int samplesCount) {
+	estimate_t result;
+	long insideCount = 0;
+	double sum = 0.0, sumSquares = 0.0;
+	for (int i = 0; i < workers; i++) {
+		double slice = 4.0 * (double) hits[i] / (double) samplesCount;
+		insideCount += hits[i];
+		sum += slice;
+		sumSquares += slice * slice;
+	}
+	result.samples = (long) workers * samplesCount;
+	result.pi = 4.0 * (double) insideCount / (double) result.samples;
+	if (workers > 1) {
+		double variance = (sumSquares - sum * sum / workers) / (workers - 1);
+		result.error = sqrt(fmax(variance, 0.0) / workers);
+	} else {
+		double p = result.pi / 4.0;
+		result.error = 4.0 * sqrt(p * (1.0 - p) / result.samples);
+	}
+	return result;
+}
 
-	if (argc >= 2) {
-		*threadCount = atoi(argv[1]);
-		if (*threadCount <= 0) {
-			printf("Invalid value for 'threadCount'");
-			exit(EXIT_FAILURE);
+/* procs shard processes run threadCount workers each, shard s owns workers s*threadCount ..
+ * (s+1)*threadCount-1. Partial counts come back over one pipe and are summed per worker,
+ * the parent checks that every worker reported its whole slice. */
+estimate_t estimate_shards(int procs, int threadCount, int samplesCount, sampler_t sampler, uint64_t masterSeed, const cpuPlan_t *plan) {
+	int fd[2], workers = procs * threadCount, status, failed = 0;
+	ssize_t count;
+	shardReport_t report;
+	estimate_t result;
+	long *hits = (long*) calloc(workers, sizeof(long));
+	long *done = (long*) calloc(workers, sizeof(long));
+	if (hits == NULL || done == NULL) ERR("Malloc error for hit counts!");
+	if (pipe(fd)) ERR("pipe");
+	fflush(stdout);
+	for (int s = 0; s < procs; s++) {
+		switch (fork()) {
+			case 0:
+				if (close(fd[0])) ERR("close");
+				run_shard(s, threadCount, samplesCount, sampler, masterSeed, plan, fd[1]);
+				exit(EXIT_SUCCESS);
+			case -1: ERR("fork");
 		}
 	}
-	if (argc >= 3) {
-		*samplesCount = atoi(argv[2]);
-		if (*samplesCount <= 0) {
-			printf("Invalid value for 'samplesCount'");
+	if (close(fd[1])) ERR("close");
+	while ((count = TEMP_FAILURE_RETRY(read(fd[0], &report, sizeof(report)))) == sizeof(report)) {
+		if (report.worker < 0 || report.worker >= workers) {
+			fprintf(stderr, "Invalid report from worker %d\n", report.worker);
 			exit(EXIT_FAILURE);
 		}
+		hits[report.worker] += report.hits;
+		done[report.worker] += report.samples;
+	}
+	if (count < 0) ERR("read");
+	if (close(fd[0])) ERR("close");
+	for (int s = 0; s < procs; s++) {
+		if (TEMP_FAILURE_RETRY(wait(&status)) < 0) ERR("wait");
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) failed++;
+	}
+	for (int w = 0; w < workers; w++)
+		if (done[w] != samplesCount) failed++;
+	if (failed) {
+		fprintf(stderr, "Shards failed, %d workers or processes did not finish\n", failed);
+		exit(EXIT_FAILURE);
 	}
+	result = merge_estimate(hits, workers, samplesCount);
+	free(hits);
+	free(done);
+	return result;
+}
+
+void run_shard(int shard, int threadCount, int samplesCount, sampler_t sampler, uint64_t masterSeed, const cpuPlan_t *plan, int fd) {
+	long *hits = (long*) malloc(sizeof(long) * threadCount);
+	if (hits == NULL) ERR("Malloc error for hit counts!");
+	argsEstimation_t* estimations = start_workers(shard * threadCount, threadCount, samplesCount, sampler, masterSeed, plan, fd);
+	join_workers(estimations, threadCount, hits);
+	free(hits);
+	if (close(fd)) ERR("close");
 }
 
+/* Doubles the sample count of every backend until the actual error drops below accuracy */
+void benchmark(int threadCount, double accuracy, uint64_t masterSeed, const cpuPlan_t *plan) {
+	printf("sampler\tsamples\tPI\terror\n");
+	for (sampler_t sampler = 0; sampler < SAMPLER_COUNT; sampler++) {
+		estimate_t result;
+		int samplesCount = 1;
+		for (;;) {
+			result = estimate_pi(threadCount, samplesCount, sampler, masterSeed, plan);
+			if (fabs(result.pi - M_PI) <= accuracy || samplesCount > BENCH_MAXSAMPLES / (2 * threadCount)) break;
+			samplesCount *= 2;
+		}
+		printf("%s\t%ld\t%f\t%e%s\n", samplerNames[sampler], result.samples, result.pi,
+			fabs(result.pi - M_PI), fabs(result.pi - M_PI) > accuracy ? " (not reached)" : "");
+	}
+}
+
+/* Weak scaling: samplesCount per thread, 1,2,4.. threadCount threads, unpinned and pinned
+ * (AFFINITY plan if given, topology order otherwise) */
+void scaling_benchmark(int threadCount, int samplesCount, uint64_t masterSeed, const cpuPlan_t *plan) {
+	cpuPlan_t pinned = *plan;
+	struct timespec start, end;
+	if (pinned.count == 0 && affinity_topology(&pinned)) ERR("Couldn't read CPU topology");
+	printf("threads\tunpinned[s]\tpinned[s]\tunpinned[Msamples/s]\tpinned[Msamples/s]\n");
+	for (int t = 1; t <= threadCount; t = t < threadCount && 2 * t > threadCount ? threadCount : 2 * t) {
+		double elapsed[2];
+		for (int p = 0; p < 2; p++) {
+			if (clock_gettime(CLOCK_MONOTONIC, &start)) ERR("clock_gettime");
+			estimate_pi(t, samplesCount, SAMPLER_PRNG, masterSeed, p ? &pinned : NULL);
+			if (clock_gettime(CLOCK_MONOTONIC, &end)) ERR("clock_gettime");
+			elapsed[p] = ELAPSED(start, end);
+		}
+		double samples = (double) t * samplesCount * 1e-6;
+		printf("%d\t%.3f\t%.3f\t%.1f\t%.1f\n", t, elapsed[0], elapsed[1], samples / elapsed[0], samples / elapsed[1]);
+		if (t == threadCount) break;
+	}
+}
+
+/* The same number of workers (workers*samplesCount samples) as threads of one process,
+ * one thread per shard process and every procs x threads split in between */
+void layout_benchmark(int workers, int samplesCount, uint64_t masterSeed, const cpuPlan_t *plan) {
+	struct timespec start, end;
+	estimate_t result;
+	printf("layout\tprocs\tthreads\ttime[s]\tMsamples/s\tPI\n");
+	for (int procs = 1; procs <= workers; procs++) {
+		if (workers % procs) continue;
+		if (clock_gettime(CLOCK_MONOTONIC, &start)) ERR("clock_gettime");
+		if (procs == 1) result = estimate_pi(workers, samplesCount, SAMPLER_PRNG, masterSeed, plan);
+		else result = estimate_shards(procs, workers / procs, samplesCount, SAMPLER_PRNG, masterSeed, plan);
+		if (clock_gettime(CLOCK_MONOTONIC, &end)) ERR("clock_gettime");
+		printf("%s\t%d\t%d\t%.3f\t%.1f\t%.9f\n", procs == 1 ? "threads" : procs == workers ? "processes" : "hybrid",
+			procs, workers / procs, ELAPSED(start, end), result.samples * 1e-6 / ELAPSED(start, end), result.pi);
+	}
+}
+
+/* The worker copies its arguments to its own stack, the state it updates (its PRNG stream)
+ * is first touched by the worker on its CPU and does not share cache lines with other threads */
 void* pi_estimation(void *voidPtr) {
-	argsEstimation_t *args = voidPtr;
-	double* result;
-	if(NULL==(result=malloc(sizeof(double)))) ERR("malloc");;
-
-	int insideCount = 0;
-	for (int i = 0; i < args->samplesCount; i++) {
-		double x = ((double) rand_r(&args->seed) / (double) RAND_MAX);
-		double y = ((double) rand_r(&args->seed) / (double) RAND_MAX);
-		if (sqrt(x*x+y*y) <= 1.0) insideCount ++;
+	argsEstimation_t args = *(argsEstimation_t*) voidPtr;
+	long* result;
+	perfMark_t mark;
+	if(NULL==(result=malloc(sizeof(long)))) ERR("malloc");;
+	perf_begin(&mark, samplerNames[args.sampler]);
+	*result = args.reportFd < 0 ? count_samples(&args) : stream_samples(&args);
+	perf_end(&mark);
+	return result;
+}
+
+long count_samples(argsEstimation_t *args) {
+	switch (args->sampler) {
+		case SAMPLER_HALTON: return halton_count(args);
+		case SAMPLER_SOBOL: return sobol_count(args);
+		default: return prng_count(args);
 	}
-	*result = 4.0 * (double) insideCount / (double) args->samplesCount;
+}
+
+/* Shard worker: the slice is counted SHARD_CHUNK samples at a time and every piece is reported.
+ * The PRNG stream continues and the index moves on, the pieces add up to the same hits as one call. */
+long stream_samples(argsEstimation_t *args) {
+	shardReport_t report = { args->worker, 0, 0 };
+	int total = args->samplesCount;
+	long insideCount = 0;
+	for (int done = 0; done < total; done += report.samples) {
+		args->samplesCount = report.samples = total - done < SHARD_CHUNK ? total - done : SHARD_CHUNK;
+		report.hits = count_samples(args);
+		args->firstIndex += report.samples;
+		insideCount += report.hits;
+		if (TEMP_FAILURE_RETRY(write(args->reportFd, &report, sizeof(report))) != sizeof(report)) ERR("write");
+	}
+	return insideCount;
+}
+
+/* Coordinates are drawn PRNG_BATCH at a time, the loop over the batch has no calls and vectorizes */
+long prng_count(argsEstimation_t *args) {
+	double u[2 * PRNG_BATCH];
+	long insideCount = 0;
+	for (int i = 0; i < args->samplesCount; i += PRNG_BATCH) {
+		int count = args->samplesCount - i < PRNG_BATCH ? args->samplesCount - i : PRNG_BATCH;
+		prng_fill_double(&args->rng, u, 2 * count);
+		for (int j = 0; j < count; j++)
+			if (u[2*j]*u[2*j]+u[2*j+1]*u[2*j+1] <= 1.0) insideCount ++;
+	}
+	return insideCount;
+}
+
+double radical_inverse(long index, int base) {
+	double result = 0.0, digit = 1.0 / base;
+	for (; index > 0; index /= base, digit /= base)
+		result += (index % base) * digit;
 	return result;
 }
+
+/* Halton points are computed directly from the index, skip-ahead is free.
+ * Index 0 (the origin) is skipped. */
+long halton_count(argsEstimation_t *args) {
+	long insideCount = 0;
+	for (long i = args->firstIndex + 1; i <= args->firstIndex + args->samplesCount; i++) {
+		double x = radical_inverse(i, 2);
+		double y = radical_inverse(i, 3);
+		if (sqrt(x*x+y*y) <= 1.0) insideCount ++;
+	}
+	return insideCount;
+}
+
+uint32_t reverse_bits(uint32_t x) {
+	x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+	x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+	x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+	x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+	return (x >> 16) | (x << 16);
+}
+
+/* Hash based nested uniform (Owen) scrambling, Laine-Karras permutation on reversed bits */
+uint32_t owen_scramble(uint32_t x, uint32_t seed) {
+	x = reverse_bits(x);
+	x += seed;
+	x ^= x * 0x6c50b47cu;
+	x ^= x * 0xb82f1e52u;
+	x ^= x * 0xc7afe638u;
+	x ^= x * 0x8d22f6e6u;
+	return reverse_bits(x);
+}
+
+/* First two Sobol dimensions in Gray code order. The first point of a slice is computed
+ * directly from its index, following ones by flipping one direction number (Antonov-Saleev). */
+long sobol_count(argsEstimation_t *args) {
+	uint32_t v[2][SOBOL_BITS], sx = 0, sy = 0;
+	long insideCount = 0, i = args->firstIndex;
+	for (int k = 0; k < SOBOL_BITS; k++) {
+		v[0][k] = 1u << (SOBOL_BITS - 1 - k);
+		v[1][k] = k ? v[1][k-1] ^ (v[1][k-1] >> 1) : 1u << (SOBOL_BITS - 1);
+	}
+	for (long gray = i ^ (i >> 1), k = 0; gray; gray >>= 1, k++)
+		if (gray & 1) { sx ^= v[0][k]; sy ^= v[1][k]; }
+	for (int n = 0; n < args->samplesCount; n++, i++) {
+		if (n) {
+			int k = __builtin_ctzl(i);
+			sx ^= v[0][k];
+			sy ^= v[1][k];
+		}
+		double x = (owen_scramble(sx, args->scramble) + 0.5) / 4294967296.0;
+		double y = (owen_scramble(sy, args->scramble ^ 0x9e3779b9u) + 0.5) / 4294967296.0;
+		if (sqrt(x*x+y*y) <= 1.0) insideCount ++;
+	}
+	return insideCount;
+}
 /*
 This and following programs do not show USAGE information, the default parameters values are assumed if options are missing. Run it without parameters to see how it works.
 Functions' declarations at the beginning of the code (not the functions definitions) are quite useful, sometimes mandatory. If you do not know the difference please read this.
-In multi threaded processes you can not correctly use rand() function, use rand_r() instead. The later one requires individual seed for every thread.
+In multi threaded processes you can not correctly use rand() function (one locked state shared by all the threads) and rand_r() has only 32 bits of state, every thread gets its own stream split from one master stream instead (../prng.h).
 This program uses the simplest schema for threads lifetime. It creates some threads and then immediately waits for them to finish. More complex scenarios are possible
 Please keep in mind that nearly every call to system function (and most calls to library functions) should be followed with the test on errors and if necessary by the proper reaction on the error.
 ERR macro does not send "kill" signal as in multi-process program, why ?
@@ -99,12 +484,10 @@ How input data is passed to the new threads?
 Ad:Exclusively by the pointer to structure argsEstimation_t that is passed as thread function arguments. There is no need (nor the excuse) to use global variables!
 Is the thread input data shared between the threads?
 Ad:Not in this program. In this case there is no need to synchronize the access to this data. Each thread gets a pointer to the private copy of the structure.
-How the random seed for rand_r() is prepared for each thread?
-Ad:It is randomized in the main thread and passed as a part of input data in argsEstimation_t .
-In this multi thread program we see srand/rand calls, is this correct? It contradicts what was said a few lines above.
-Ad:Only one thread is using srand/rand and those functions are called before working threads come to life. The problem with srand/rand and threads originates from one global variable used in the library to hold the current seed. In this code only on thread access this seed thus it is correct.
+How the random stream is prepared for each thread?
+Ad:The main thread seeds one master stream (PRNG_SEED or time, see ../prng.h) and splits a stream for every thread from it, it is passed as a part of input data in argsEstimation_t. The streams do not overlap and the same PRNG_SEED gives the same estimate.
 Can we share one input data structure for all the threads instead of having a copy for every thread?
-Ad:No due to random seed, it must be different for all the threads.
+Ad:No due to random stream, it must be different for all the threads.
 Can we make the array with the thread input data automatic variable (not allocated)? 
 Ad:Only if we add some limit on the number of working threads (up to 1000) otherwise this array may use all the stack of the main thread.
 Why do we need to release the memory returned from the working thread?
@@ -113,4 +496,13 @@ Why can't we return the data as the address of local (to the thread) automatic v
 Ad:The moment thread terminates is the moment of its stack memory release. If you have a pointer to this released stack you should not use it as this memory can be overwritten immediately. What worse, in most cases this memory will stil be the same and faulty program will work in 90% of cases. If you make this kind of mistake it is later very hard to find out why sometimes your code fails. Please be careful and try to avoid this flaw.
 can we avoid memory allocation in the working thread?
 Ad:Yes, if we add extra variable to the input structure of the thread. The result can then be stored in this variable.
+Optional third parameter selects the sampler: prng (xoshiro256** from ../prng.h, default), halton or sobol (Owen scrambled), optional fourth parameter turns on the benchmark that doubles the samples until the given accuracy is reached, e.g. "17 8 1 prng 1e-4".
+Why the low-discrepancy samplers converge faster?
+Ad:Their points fill the square evenly by construction, the error shrinks close to 1/N instead of 1/sqrt(N) for pseudo random pairs.
+Why the thread results are now returned as hit counts, not as PI estimates?
+Ad:Each thread takes a disjoint slice of one sequence, integer sums do not depend on the order nor on the number of threads, with QMC samplers the parallel result is exactly the same as the sequential one.
+Set AFFINITY environment variable to pin the workers (see affinity.h), "17 64 1000000 scaling" prints the scaling curve with and without pinning.
+"17 4 1000000 --procs 2 [sampler]" forks 2 shard processes with 4 threads each. Workers are numbered across the shards, worker w gets the w-th split stream and the w-th slice, so the estimate is the same as "17 8 1000000" with the same PRNG_SEED. The workers write partial hit counts (shardReport_t) to one pipe, the parent sums them per worker and merges in worker order. "17 8 1000000 layouts" runs 8 workers as threads only, processes only and every split in between.
+Why is a pipe enough to collect the results from threads of many processes?
+Ad:Every record is written with one write call and is smaller than PIPE_BUF, such writes are atomic, records from different writers never mix. The parent gets EOF after the last shard closes its end.
 */
\ No newline at end of file
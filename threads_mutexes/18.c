@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stddef.h>
 #include <stdlib.h>
 #include <stdarg.h>
@@ -5,12 +6,15 @@
 #include <string.h>
 #include <unistd.h>
 #include <pthread.h>
+#include "affinity.h"
+#include "../perfregions.h"
+#include "../prng.h"
+#include "lockprof.h"
 
 #define MAXLINE 4096
 #define DEFAULT_N 1000
 #define DEFAULT_K 10
 #define BIN_COUNT 11
-#define NEXT_DOUBLE(seedptr) ((double) rand_r(seedptr) / (double) RAND_MAX)
 #define ERR(source) (perror(source),\
 		     fprintf(stderr,"%s:%d\n",__FILE__,__LINE__),\
 		     exit(EXIT_FAILURE))
@@ -18,7 +22,7 @@
 typedef unsigned int UINT;
 typedef struct argsThrower{
 	pthread_t tid;
-	UINT seed;
+	prng_t rng;
 	int *pBallsThrown;
 	int *pBallsWaiting;
 	int *bins;
@@ -28,13 +32,19 @@ typedef struct argsThrower{
 } argsThrower_t;
 
 void ReadArguments(int argc, char** argv, int *ballsCount, int *throwersCount);
-void make_throwers(argsThrower_t *argsArray, int throwersCount);
+void make_throwers(argsThrower_t *argsArray, int throwersCount, const cpuPlan_t *plan);
 void* throwing_func(void* args);
-int throwBall(UINT* seedptr);
+int throwBall(prng_t* rng);
 
 int main(int argc, char** argv) {
 	int ballsCount, throwersCount;
 	ReadArguments(argc, argv, &ballsCount, &throwersCount);
+	cpuPlan_t plan;
+	if (affinity_plan(&plan) < 0) {
+		printf("Invalid value for 'AFFINITY'");
+		exit(EXIT_FAILURE);
+	}
+	perf_init();
 	int ballsThrown = 0, bt=0;
 	int ballsWaiting = ballsCount;
 	pthread_mutex_t mxBallsThrown = PTHREAD_MUTEX_INITIALIZER;
@@ -47,9 +57,10 @@ int main(int argc, char** argv) {
 	}
 	argsThrower_t* args = (argsThrower_t*) malloc(sizeof(argsThrower_t) * throwersCount);
 	if (args == NULL) ERR("Malloc error for throwers arguments!");
-	srand(time(NULL));
+	prng_t master;
+	prng_seed(&master, prng_master());
 	for (int i = 0; i < throwersCount; i++) {
-		args[i].seed = (UINT) rand();
+		prng_split(&master, &args[i].rng);
 		args[i].pBallsThrown = &ballsThrown;
 		args[i].pBallsWaiting = &ballsWaiting;
 		args[i].bins = bins;
@@ -57,7 +68,7 @@ int main(int argc, char** argv) {
 		args[i].pmxBallsWaiting = &mxBallsWaiting;
 		args[i].mxBins = mxBins;
 	}
-	make_throwers(args, throwersCount);
+	make_throwers(args, throwersCount, &plan);
 	while (bt<ballsCount) {
 		sleep(1);
 		pthread_mutex_lock(&mxBallsThrown);
@@ -98,11 +109,12 @@ void ReadArguments(int argc, char** argv, int *ballsCount, int *throwersCount) {
 	}
 }
 
-void make_throwers(argsThrower_t *argsArray, int throwersCount) {
+void make_throwers(argsThrower_t *argsArray, int throwersCount, const cpuPlan_t *plan) {
 	pthread_attr_t threadAttr;
 	if(pthread_attr_init(&threadAttr)) ERR("Couldn't create pthread_attr_t");
 	if(pthread_attr_setdetachstate(&threadAttr, PTHREAD_CREATE_DETACHED)) ERR("Couldn't setdetachsatate on pthread_attr_t");
 	for (int i = 0; i < throwersCount; i++) {
+		if(affinity_attr(&threadAttr, plan, i)) ERR("Couldn't set thread affinity");
 		if(pthread_create(&argsArray[i].tid, &threadAttr, throwing_func, &argsArray[i])) ERR("Couldn't create thread");
 	}
 	pthread_attr_destroy(&threadAttr);
@@ -110,6 +122,8 @@ void make_throwers(argsThrower_t *argsArray, int throwersCount) {
 
 void* throwing_func(void* voidArgs) {
 	argsThrower_t* args = voidArgs;
+	prng_t rng = args->rng;
+	perfMark_t mark;
 	while (1) {
 		pthread_mutex_lock(args->pmxBallsWaiting);
 		if (*args->pBallsWaiting > 0) {
@@ -119,7 +133,9 @@ void* throwing_func(void* voidArgs) {
 			pthread_mutex_unlock(args->pmxBallsWaiting);
 			break;
 		}
-		int binno = throwBall(&args->seed);
+		perf_begin(&mark, "throwBall");
+		int binno = throwBall(&rng);
+		perf_end(&mark);
 		pthread_mutex_lock(&args->mxBins[binno]);
 		args->bins[binno] += 1;
 		pthread_mutex_unlock(&args->mxBins[binno]);
@@ -131,10 +147,12 @@ void* throwing_func(void* voidArgs) {
 }
 
 /* returns # of bin where ball has landed */
-int throwBall(UINT* seedptr) {
+int throwBall(prng_t* rng) {
+	double u[BIN_COUNT - 1];
 	int result = 0;
+	prng_fill_double(rng, u, BIN_COUNT - 1);
 	for (int i = 0; i < BIN_COUNT - 1; i++) 
-		if (NEXT_DOUBLE(seedptr) > 0.5) result++;
+		if (u[i] > 0.5) result++;
 	return result;
 }
 
@@ -157,4 +175,6 @@ To check if the working threads terminated, the main threads periodically checks
 Ad:No, it is so called "soft busy waiting" but without synchronization tool like conditional variable it can not be solved better.
 Do all the threads created in this program really work?
 Ad:No ,especially when there is a lot of threads. It is possible that some of threads "starve". The work code for the thread is very fast, thread creation is rather slow, it is possible that last threads created will have no beans left to throw. To check it please add per thread thrown beans counters and print them on stdout at the thread termination. The problem can be avoided if we add synchronization on threads start - make them start at the same time but this again requires the methods that will be introduced during OPS2 (barier or conditional variable).
+Set AFFINITY environment variable to pin the throwers (see affinity.h). Each thrower keeps its PRNG stream (split from one master stream, see ../prng.h) in a local variable, updating it in the shared args array would bounce one cache line between the CPUs of neighbouring throwers.
+Compile with -DLOCK_PROFILE to get a ranked report of mutex contention at exit (see lockprof.h).
 */
\ No newline at end of file
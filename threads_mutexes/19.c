@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stddef.h>
 #include <stdlib.h>
 #include <stdarg.h>
@@ -8,10 +9,17 @@
 #include <pthread.h>
 #include <signal.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include "../perfregions.h"
+#include "../prng.h"
+#include "lockprof.h"
 
 #define MAXLINE 4096
 #define DEFAULT_ARRAYSIZE 10
 #define DELETED_ITEM -1
+#define MAX_ITEM_TEXT 12
+#define ELAPSED(start,end) ((end).tv_sec-(start).tv_sec)+(((end).tv_nsec - (start).tv_nsec) * 1.0e-9)
 #define ERR(source) (perror(source),\
 		     fprintf(stderr,"%s:%d\n",__FILE__,__LINE__),\
 		     exit(EXIT_FAILURE))
@@ -20,23 +28,43 @@ typedef struct argsSignalHandler {
 	pthread_t tid;
 	int *pArrayCount;
 	int *array;
+	bool *pArrayChanged;
 	pthread_mutex_t *pmxArray;
 	sigset_t *pMask;
 	bool *pQuitFlag;
 	pthread_mutex_t *pmxQuitFlag;
+	prng_t rng;
 } argsSignalHandler_t;
+typedef struct renderBuffer {
+	int *snapshot;
+	char *text;
+	size_t length;
+} renderBuffer_t;
 
-void ReadArguments(int argc, char** argv, int *arraySize);
+void ReadArguments(int argc, char** argv, int *arraySize, bool *bench);
 void removeItem(int *array, int *arrayCount, int index);
 void printArray(int *array, int arraySize);
+void renderArray(renderBuffer_t *render, int arraySize);
+void alloc_render(renderBuffer_t *render, int arraySize);
+void free_render(renderBuffer_t *render);
+ssize_t bulk_write(int fd, char *buf, size_t count);
+void benchmark(void);
 void* signal_handling(void*);
 
 int main(int argc, char** argv) {
 	int arraySize,*array;
-	bool quitFlag = false;
+	bool quitFlag = false, arrayChanged = true, bench;
+	renderBuffer_t render;
+	perfMark_t mark;
 	pthread_mutex_t mxQuitFlag = PTHREAD_MUTEX_INITIALIZER;
 	pthread_mutex_t mxArray = PTHREAD_MUTEX_INITIALIZER;
-	ReadArguments(argc, argv, &arraySize);
+	ReadArguments(argc, argv, &arraySize, &bench);
+	if (bench) {
+		benchmark();
+		exit(EXIT_SUCCESS);
+	}
+	perf_init();
+	alloc_render(&render, arraySize);
 	int arrayCount = arraySize;
 	if(NULL==(array = (int*) malloc(sizeof(int) * arraySize)))ERR("Malloc error for array!");
 	for (int i =0; i < arraySize; i++) array[i] = i + 1;
@@ -48,10 +76,12 @@ int main(int argc, char** argv) {
 	argsSignalHandler_t args;
 	args.pArrayCount = &arrayCount;
 	args.array = array;
+	args.pArrayChanged = &arrayChanged;
 	args.pmxArray = &mxArray;
 	args.pMask = &newMask;
 	args.pQuitFlag = &quitFlag;
 	args.pmxQuitFlag = &mxQuitFlag;
+	prng_seed(&args.rng, prng_master());
 	if(pthread_create(&args.tid, NULL, signal_handling, &args))ERR("Couldn't create signal handling thread!");
 	while (true) {
 		pthread_mutex_lock(&mxQuitFlag);
@@ -60,22 +90,39 @@ int main(int argc, char** argv) {
 			break;
 		} else {
 			pthread_mutex_unlock(&mxQuitFlag);
+			bool dirty = false;
 			pthread_mutex_lock(&mxArray);
-			printArray(array, arraySize);
+			if (arrayChanged) {
+				memcpy(render.snapshot, array, sizeof(int) * arraySize);
+				arrayChanged = false;
+				dirty = true;
+			}
 			pthread_mutex_unlock(&mxArray);
+			perf_begin(&mark, "renderArray");
+			if (dirty) renderArray(&render, arraySize);
+			perf_end(&mark);
+			perf_begin(&mark, "write_array");
+			if (bulk_write(STDOUT_FILENO, render.text, render.length) < 0) ERR("write");
+			perf_end(&mark);
 			sleep(1);
 		}
 	}
 	if(pthread_join(args.tid, NULL)) ERR("Can't join with 'signal handling' thread");
 	free(array);
+	free_render(&render);
 	if (pthread_sigmask(SIG_UNBLOCK, &newMask, &oldMask)) ERR("SIG_BLOCK error");
 	exit(EXIT_SUCCESS);
 }
 
-void ReadArguments(int argc, char** argv, int *arraySize)
+void ReadArguments(int argc, char** argv, int *arraySize, bool *bench)
 {
 	*arraySize = DEFAULT_ARRAYSIZE;
+	*bench = false;
 
+	if (argc >= 2 && !strcmp(argv[1], "bench")) {
+		*bench = true;
+		return;
+	}
 	if (argc >= 2) {
 		*arraySize = atoi(argv[1]);
 		if (*arraySize <= 0) {
@@ -105,17 +152,108 @@ void printArray(int* array, int arraySize) {
 	printf(" ]\n");
 }
 
+void alloc_render(renderBuffer_t *render, int arraySize) {
+	render->snapshot = (int*) malloc(sizeof(int) * arraySize);
+	render->text = (char*) malloc((size_t) arraySize * MAX_ITEM_TEXT + 4);
+	if (render->snapshot == NULL || render->text == NULL) ERR("Malloc error for render buffers!");
+	render->length = 0;
+}
+
+void free_render(renderBuffer_t *render) {
+	free(render->snapshot);
+	free(render->text);
+}
+
+/* Same text as printArray, formatted from the snapshot without stdio,
+ * digits are produced two at a time from a lookup table */
+void renderArray(renderBuffer_t *render, int arraySize) {
+	static const char digitPairs[] =
+		"00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+		"40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+		"8081828384858687888990919293949596979899";
+	char *out = render->text, tmp[MAX_ITEM_TEXT];
+	*out++ = '[';
+	for (int i = 0; i < arraySize; i++) {
+		unsigned int value = render->snapshot[i];
+		if (render->snapshot[i] == DELETED_ITEM) continue;
+		char *p = tmp + MAX_ITEM_TEXT;
+		while (value >= 100) {
+			p -= 2;
+			memcpy(p, digitPairs + 2 * (value % 100), 2);
+			value /= 100;
+		}
+		if (value >= 10) {
+			p -= 2;
+			memcpy(p, digitPairs + 2 * value, 2);
+		} else *--p = '0' + value;
+		*out++ = ' ';
+		memcpy(out, p, tmp + MAX_ITEM_TEXT - p);
+		out += tmp + MAX_ITEM_TEXT - p;
+	}
+	memcpy(out, " ]\n", 3);
+	render->length = out + 3 - render->text;
+}
+
+ssize_t bulk_write(int fd, char *buf, size_t count){
+	ssize_t c;
+	ssize_t len=0;
+	do{
+		c=TEMP_FAILURE_RETRY(write(fd,buf,count));
+		if(c<0) return c;
+		buf+=c;
+		len+=c;
+		count-=c;
+	}while(count>0);
+	return len ;
+}
+
+/* Times printArray against renderArray on 10^6 and 10^7 items with every
+ * tenth item deleted, output goes to /dev/null */
+void benchmark(void) {
+	int sizes[] = { 1000000, 10000000 };
+	struct timespec start, end;
+	int fd;
+	if ((fd = TEMP_FAILURE_RETRY(open("/dev/null", O_WRONLY))) < 0) ERR("open");
+	fflush(stdout);
+	int out = dup(STDOUT_FILENO);
+	if (out < 0) ERR("dup");
+	for (int s = 0; s < 2; s++) {
+		int arraySize = sizes[s];
+		renderBuffer_t render;
+		alloc_render(&render, arraySize);
+		for (int i = 0; i < arraySize; i++) render.snapshot[i] = i % 10 ? i + 1 : DELETED_ITEM;
+		if (dup2(fd, STDOUT_FILENO) < 0) ERR("dup2");
+		if (clock_gettime(CLOCK_MONOTONIC, &start)) ERR("Failed to retrieve time!");
+		printArray(render.snapshot, arraySize);
+		fflush(stdout);
+		if (clock_gettime(CLOCK_MONOTONIC, &end)) ERR("Failed to retrieve time!");
+		double stdioTime = ELAPSED(start, end);
+		if (clock_gettime(CLOCK_MONOTONIC, &start)) ERR("Failed to retrieve time!");
+		renderArray(&render, arraySize);
+		if (bulk_write(STDOUT_FILENO, render.text, render.length) < 0) ERR("write");
+		if (clock_gettime(CLOCK_MONOTONIC, &end)) ERR("Failed to retrieve time!");
+		double renderTime = ELAPSED(start, end);
+		if (dup2(out, STDOUT_FILENO) < 0) ERR("dup2");
+		printf("%d items: printf %.3f s, render+write %.3f s (%zu bytes), speedup %.1fx\n",
+			arraySize, stdioTime, renderTime, render.length, stdioTime / renderTime);
+		fflush(stdout);
+		free_render(&render);
+	}
+	if (close(out) || close(fd)) ERR("close");
+}
+
 void* signal_handling(void* voidArgs) {
 	argsSignalHandler_t* args = voidArgs;
 	int signo;
-	srand(time(NULL));
 	for (;;) {
 		if(sigwait(args->pMask, &signo)) ERR("sigwait failed.");
 		switch (signo) {
 			case SIGINT:
 				pthread_mutex_lock(args->pmxArray);
-				if (*args->pArrayCount >  0)
-					removeItem(args->array, args->pArrayCount, rand() % (*args->pArrayCount));
+				if (*args->pArrayCount >  0) {
+					removeItem(args->array, args->pArrayCount, prng_below(&args->rng, *args->pArrayCount));
+					*args->pArrayChanged = true;
+				}
 				pthread_mutex_unlock(args->pmxArray);
 				break;
 			case SIGQUIT:
@@ -148,4 +286,8 @@ Can we use sigprocmask instead of pthread_sigmask in this program?
 Ad:Yes, the signal blocking is set prior to thread creation, still in single thread phase of the program.
 Why system calls to functions operating on mutex (acquire, release) are not tested for errors?
 Ad:Basic mutex type (the type used in this program, default one) is not checking nor reporting errors. Adding those checks would not be such a bad idea as they are not harming the code and if you decide to later change the mutex type to error checking it will not require many changes in the code.
+Main thread prints the array with one write from the text rendered out of a private snapshot, the mutex is held only for the memcpy. Text is rendered again only if the signal thread removed an item since the last printout (arrayChanged flag). Run "19 bench" to compare it with printArray.
+Why the snapshot is needed, can't we render straight from the shared array?
+Ad:We can, but only under the mutex, formatting millions of numbers would block the signal handling thread for the whole time.
+Compile with -DLOCK_PROFILE to get a ranked report of mutex contention at exit (see lockprof.h).
 */
\ No newline at end of file
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stddef.h>
 #include <stdlib.h>
 #include <stdarg.h>
@@ -8,6 +9,10 @@
 #include <time.h>
 #include <pthread.h>
 #include <errno.h>
+#include "affinity.h"
+#include "../perfregions.h"
+#include "../prng.h"
+#include "lockprof.h"
 
 #define MAXLINE 4096
 #define DEFAULT_STUDENT_COUNT 100
@@ -32,16 +37,43 @@ typedef struct argsModify {
 	yearCounters_t *pYearCounters;
 	int year;
 } argsModify_t;
-void ReadArguments(int argc, char** argv, int *studentsCount);
+typedef enum eventType { EVENT_YEAR_END, EVENT_KICK } eventType_t;
+typedef struct event {
+	long time;
+	long seq;
+	eventType_t type;
+	int student;
+} event_t;
+typedef struct eventQueue {
+	event_t *heap;
+	int size;
+	long seq;
+} eventQueue_t;
+void ReadArguments(int argc, char** argv, int *studentsCount, int *simRuns);
 void* student_life(void*);
 void increment_counter(argsModify_t *args);
 void decrement_counter(argsModify_t *args);
 void msleep(UINT milisec);
-void kick_student(studentsList_t *studentsList);
+void kick_student(studentsList_t *studentsList, prng_t *rng);
+void queue_push(eventQueue_t *queue, long time, eventType_t type, int student);
+event_t queue_pop(eventQueue_t *queue);
+void simulate(int studentsCount, int runs);
 
 int main(int argc, char** argv) {
-	int studentsCount;
-	ReadArguments(argc, argv, &studentsCount);
+	int studentsCount, simRuns;
+	ReadArguments(argc, argv, &studentsCount, &simRuns);
+	if (simRuns > 0) {
+		simulate(studentsCount, simRuns);
+		exit(EXIT_SUCCESS);
+	}
+	cpuPlan_t plan;
+	pthread_attr_t threadAttr;
+	if (affinity_plan(&plan) < 0) {
+		printf("Invalid value for 'AFFINITY'");
+		exit(EXIT_FAILURE);
+	}
+	perf_init();
+	if (pthread_attr_init(&threadAttr)) ERR("Couldn't create pthread_attr_t");
 	yearCounters_t counters = {
 		.values = { 0, 0, 0, 0 },
 		.mxCounters = {
@@ -58,15 +90,22 @@ int main(int argc, char** argv) {
 	if (studentsList.thStudents == NULL || studentsList.removed == NULL) 
 		ERR("Failed to allocate memory for 'students list'!");
 	for (int i = 0; i < studentsCount; i++) studentsList.removed[i] = false;
-	for (int i = 0; i < studentsCount; i++)
-		if(pthread_create(&studentsList.thStudents[i], NULL, student_life, &counters)) ERR("Failed to create student thread!");
-	srand(time(NULL));
+	for (int i = 0; i < studentsCount; i++) {
+		if(affinity_attr(&threadAttr, &plan, i)) ERR("Couldn't set thread affinity");
+		if(pthread_create(&studentsList.thStudents[i], &threadAttr, student_life, &counters)) ERR("Failed to create student thread!");
+	}
+	pthread_attr_destroy(&threadAttr);
+	prng_t rng;
+	prng_seed(&rng, prng_master());
 	timespec_t start, current;
+	perfMark_t mark;
 	if (clock_gettime(CLOCK_REALTIME, &start)) ERR("Failed to retrieve time!");
 	do {
-		msleep(rand() % 201 + 100);
+		msleep(prng_below(&rng, 201) + 100);
 		if (clock_gettime(CLOCK_REALTIME, &current)) ERR("Failed to retrieve time!");
-		kick_student(&studentsList);
+		perf_begin(&mark, "kick_student");
+		kick_student(&studentsList, &rng);
+		perf_end(&mark);
 	}
 	while (ELAPSED(start, current) < 4.0);
 	for (int i = 0; i < studentsCount; i++) 
@@ -80,8 +119,9 @@ int main(int argc, char** argv) {
 	exit(EXIT_SUCCESS);
 }
 
-void ReadArguments(int argc, char** argv, int *studentsCount) {
+void ReadArguments(int argc, char** argv, int *studentsCount, int *simRuns) {
 	*studentsCount = DEFAULT_STUDENT_COUNT;
+	*simRuns = 0;
 	if (argc >= 2) {
 		*studentsCount = atoi(argv[1]);
 		if (*studentsCount <= 0) {
@@ -89,6 +129,20 @@ void ReadArguments(int argc, char** argv, int *studentsCount) {
 			exit(EXIT_FAILURE);
 		}
 	}
+	if (argc >= 3) {
+		if (strcmp(argv[2], "sim")) {
+			printf("Invalid value for 'mode'");
+			exit(EXIT_FAILURE);
+		}
+		*simRuns = 1;
+	}
+	if (argc >= 4) {
+		*simRuns = atoi(argv[3]);
+		if (*simRuns <= 0) {
+			printf("Invalid value for 'runs'");
+			exit(EXIT_FAILURE);
+		}
+	}
 }
 
 void* student_life(void *voidArgs) {
@@ -106,15 +160,21 @@ void* student_life(void *voidArgs) {
 }
 
 void increment_counter(argsModify_t *args) {
+	perfMark_t mark;
+	perf_begin(&mark, "update_counter");
 	pthread_mutex_lock(&(args->pYearCounters->mxCounters[args->year]));
 	args->pYearCounters->values[args->year] += 1;
 	pthread_mutex_unlock(&(args->pYearCounters->mxCounters[args->year]));
+	perf_end(&mark);
 }
 
 void decrement_counter(argsModify_t *args) {
+	perfMark_t mark;
+	perf_begin(&mark, "update_counter");
 	pthread_mutex_lock(&(args->pYearCounters->mxCounters[args->year]));
 	args->pYearCounters->values[args->year] -= 1;
 	pthread_mutex_unlock(&(args->pYearCounters->mxCounters[args->year]));
+	perf_end(&mark);
 }
 
 void msleep(UINT milisec) {
@@ -126,11 +186,11 @@ void msleep(UINT milisec) {
     if(nanosleep(&req,&req)) ERR("nanosleep");
 }
 
-void kick_student(studentsList_t *studentsList) {
+void kick_student(studentsList_t *studentsList, prng_t *rng) {
 	int idx;
 	if(0==studentsList->present) return;
 	do {
-		idx = rand() % studentsList->count;
+		idx = prng_below(rng, studentsList->count);
 	}
 	while(studentsList->removed[idx] == true);
 	pthread_cancel(studentsList->thStudents[idx]);
@@ -138,6 +198,103 @@ void kick_student(studentsList_t *studentsList) {
 	studentsList->present--;
 }
 
+
+/* Binary min-heap ordered by virtual time, events with equal time leave in insertion order */
+bool event_before(event_t *a, event_t *b) {
+	return a->time < b->time || (a->time == b->time && a->seq < b->seq);
+}
+
+void queue_push(eventQueue_t *queue, long time, eventType_t type, int student) {
+	int i = queue->size++;
+	event_t e = { .time = time, .seq = queue->seq++, .type = type, .student = student };
+	while (i > 0 && event_before(&e, &queue->heap[(i - 1) / 2])) {
+		queue->heap[i] = queue->heap[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	queue->heap[i] = e;
+}
+
+event_t queue_pop(eventQueue_t *queue) {
+	event_t top = queue->heap[0], last = queue->heap[--queue->size];
+	int i = 0, child;
+	while ((child = 2 * i + 1) < queue->size) {
+		if (child + 1 < queue->size && event_before(&queue->heap[child + 1], &queue->heap[child])) child++;
+		if (!event_before(&queue->heap[child], &last)) break;
+		queue->heap[i] = queue->heap[child];
+		i = child;
+	}
+	queue->heap[i] = last;
+	return top;
+}
+
+/* The same scenario as main on a virtual clock in milliseconds: every student starts its first
+ * year at 0 and moves on every 1000 ms, the dean kicks a random student not kicked before every
+ * 100-300 ms and stops after the first kick at or past 4000 ms. A kicked student leaves the counter
+ * of its current year (cleanup handler), a kick after graduation changes nothing. */
+void simulate(int studentsCount, int runs) {
+	eventQueue_t queue = { 0 };
+	int *year, *present, presentCount, idx;
+	long totals[4] = { 0 }, kicked[4] = { 0 };
+	int min[4], max[4];
+	timespec_t start, end;
+	event_t e;
+	prng_t rng;
+	queue.heap = (event_t*) malloc(sizeof(event_t) * (studentsCount + 1));
+	year = (int*) malloc(sizeof(int) * studentsCount);
+	present = (int*) malloc(sizeof(int) * studentsCount);
+	if (queue.heap == NULL || year == NULL || present == NULL) ERR("Failed to allocate memory for simulation!");
+	for (int j = 0; j < 4; j++) {
+		min[j] = studentsCount;
+		max[j] = 0;
+	}
+	prng_seed(&rng, prng_master());
+	if (clock_gettime(CLOCK_MONOTONIC, &start)) ERR("Failed to retrieve time!");
+	for (int run = 0; run < runs; run++) {
+		int values[4] = { studentsCount, 0, 0, 0 };
+		queue.size = 0;
+		queue.seq = 0;
+		for (int i = 0; i < studentsCount; i++) {
+			year[i] = 0;
+			present[i] = i;
+			queue_push(&queue, 1000, EVENT_YEAR_END, i);
+		}
+		presentCount = studentsCount;
+		queue_push(&queue, prng_below(&rng, 201) + 100, EVENT_KICK, -1);
+		while (queue.size > 0) {
+			e = queue_pop(&queue);
+			if (e.type == EVENT_YEAR_END) {
+				if (year[e.student] < 0) continue;
+				values[year[e.student]]--;
+				values[++year[e.student]]++;
+				if (year[e.student] < 3) queue_push(&queue, e.time + 1000, EVENT_YEAR_END, e.student);
+				continue;
+			}
+			if (presentCount > 0) {
+				idx = prng_below(&rng, presentCount);
+				e.student = present[idx];
+				present[idx] = present[--presentCount];
+				kicked[year[e.student]]++;
+				if (year[e.student] < 3) values[year[e.student]]--;
+				year[e.student] = -1;
+			}
+			if (e.time < 4000) queue_push(&queue, e.time + prng_below(&rng, 201) + 100, EVENT_KICK, -1);
+		}
+		for (int j = 0; j < 4; j++) {
+			totals[j] += values[j];
+			if (values[j] < min[j]) min[j] = values[j];
+			if (values[j] > max[j]) max[j] = values[j];
+		}
+	}
+	if (clock_gettime(CLOCK_MONOTONIC, &end)) ERR("Failed to retrieve time!");
+	const char *names[4] = { " First year", "Second year", " Third year", "  Engineers" };
+	for (int j = 0; j < 4; j++)
+		printf("%s: mean %.3f min %d max %d, kicked in this year: mean %.3f\n", names[j],
+			(double) totals[j] / runs, min[j], max[j], (double) kicked[j] / runs);
+	printf("Simulated %d runs of %d students in %.3f s\n", runs, studentsCount, (ELAPSED(start, end)));
+	free(queue.heap);
+	free(year);
+	free(present);
+}
 /*
 Threads receive the pointer to the structure with current year and pointer to years counters, structure argsModify_t does not have the same flow as one in task 2 of this tutorial i.e. program is not making too many unnecessary references to the same data.
 Structure studentsList_t is only used im main thread, it is not visible for students' threads.
@@ -162,4 +319,7 @@ Algorithm selecting a thread for cancellation has an apparent flow, can you name
 Ad:This random selection can last very long if only a few "live" threads are left on a large list of threads. Try to run the program with 10 as the parameter to check it.
 Improve random selection as an exercise.
 Have a look at the method used to measure the 4 seconds life time of the program (clock_gettime, nanosleep). Please change the solution to use alarm function and the SIGALRM handler as an exercise.
-*/
+Set AFFINITY environment variable to spread the students over chosen CPUs (see affinity.h).
+Run "20 n sim [runs]" to replay the scenario as a discrete event simulation on a virtual clock (simulate), runs repetitions take milliseconds instead of 4 seconds each and print the mean, min and max of every counter. The kick there picks from an array of students still present (swap with the last), which is also an answer to the exercise above.
+Compile with -DLOCK_PROFILE to get a ranked report of mutex contention at exit (see lockprof.h).
+*/
\ No newline at end of file
@@ -0,0 +1,125 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+/*
+Worker placement for the threads_mutexes programs, selected with the AFFINITY environment variable:
+AFFINITY unset or empty - no pinning, the scheduler places the threads (default)
+AFFINITY=topology - CPUs read from /sys/devices/system/cpu, first one hardware thread of every core (packages interleaved), then the SMT siblings
+AFFINITY=0-3,8,10-11 - explicit cpuset, CPUs are used in the given order
+Worker i is pinned to cpus[i % count] with pthread_attr_setaffinity_np, so it starts on its CPU and the memory it touches first (its stack and what it allocates) lands on the local NUMA node.
+*/
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define AFFINITY_MAXCPUS CPU_SETSIZE
+
+typedef struct cpuPlan {
+	int count;
+	int cpus[AFFINITY_MAXCPUS];
+} cpuPlan_t;
+
+/* parses "0-3,8" into plan, returns -1 on syntax error */
+static int affinity_parse(const char *spec, cpuPlan_t *plan) {
+	char *end;
+	plan->count = 0;
+	while (*spec) {
+		long first = strtol(spec, &end, 10), last = first;
+		if (end == spec || first < 0) return -1;
+		if (*end == '-') {
+			spec = end + 1;
+			last = strtol(spec, &end, 10);
+			if (end == spec || last < first) return -1;
+		}
+		for (long cpu = first; cpu <= last; cpu++) {
+			if (cpu >= AFFINITY_MAXCPUS || plan->count >= AFFINITY_MAXCPUS) return -1;
+			plan->cpus[plan->count++] = cpu;
+		}
+		if (*end == ',') end++;
+		else if (*end && *end != '\n') return -1;
+		else if (*end == '\n') end++;
+		spec = end;
+	}
+	return plan->count > 0 ? 0 : -1;
+}
+
+static int affinity_readint(int cpu, const char *name) {
+	char path[128];
+	int value = -1;
+	FILE *f;
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, name);
+	if ((f = fopen(path, "r")) == NULL) return -1;
+	if (fscanf(f, "%d", &value) != 1) value = -1;
+	fclose(f);
+	return value;
+}
+
+typedef struct cpuInfo {
+	int cpu, package, core, smt, coreRank;
+} cpuInfo_t;
+
+static int affinity_compare(const void *a, const void *b) {
+	const cpuInfo_t *x = a, *y = b;
+	if (x->smt != y->smt) return x->smt - y->smt;
+	if (x->coreRank != y->coreRank) return x->coreRank - y->coreRank;
+	if (x->package != y->package) return x->package - y->package;
+	return x->cpu - y->cpu;
+}
+
+/* Online CPUs ordered to spread the workers: SMT rank, core rank within package, package */
+static int affinity_topology(cpuPlan_t *plan) {
+	char line[4096];
+	cpuPlan_t online;
+	cpuInfo_t *info;
+	FILE *f;
+	if ((f = fopen("/sys/devices/system/cpu/online", "r")) == NULL) return -1;
+	if (fgets(line, sizeof(line), f) == NULL) line[0] = 0;
+	fclose(f);
+	if (affinity_parse(line, &online)) return -1;
+	if ((info = malloc(sizeof(cpuInfo_t) * online.count)) == NULL) return -1;
+	for (int i = 0; i < online.count; i++) {
+		info[i].cpu = online.cpus[i];
+		info[i].package = affinity_readint(info[i].cpu, "physical_package_id");
+		info[i].core = affinity_readint(info[i].cpu, "core_id");
+		info[i].smt = info[i].coreRank = 0;
+		for (int j = 0; j < i; j++) {
+			if (info[j].package != info[i].package) continue;
+			if (info[j].core == info[i].core) info[i].smt++;
+			else if (info[j].smt == 0) info[i].coreRank++;
+		}
+		if (info[i].smt) {
+			for (int j = 0; j < i; j++)
+				if (info[j].package == info[i].package && info[j].core == info[i].core && info[j].smt == 0)
+					info[i].coreRank = info[j].coreRank;
+		}
+	}
+	qsort(info, online.count, sizeof(cpuInfo_t), affinity_compare);
+	for (int i = 0; i < online.count; i++) plan->cpus[i] = info[i].cpu;
+	plan->count = online.count;
+	free(info);
+	return 0;
+}
+
+/* returns 1 if pinning was requested, 0 if not, -1 if AFFINITY could not be used */
+static int affinity_plan(cpuPlan_t *plan) {
+	const char *spec = getenv("AFFINITY");
+	plan->count = 0;
+	if (spec == NULL || *spec == 0) return 0;
+	if (!strcmp(spec, "topology")) return affinity_topology(plan) ? -1 : 1;
+	return affinity_parse(spec, plan) ? -1 : 1;
+}
+
+/* sets the CPU of worker on attr, does nothing for an empty plan */
+static int affinity_attr(pthread_attr_t *attr, const cpuPlan_t *plan, int worker) {
+	cpu_set_t set;
+	if (plan == NULL || plan->count == 0) return 0;
+	CPU_ZERO(&set);
+	CPU_SET(plan->cpus[worker % plan->count], &set);
+	return pthread_attr_setaffinity_np(attr, sizeof(cpu_set_t), &set);
+}
+
+#endif
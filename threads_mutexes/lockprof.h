@@ -0,0 +1,121 @@
+#ifndef LOCKPROF_H
+#define LOCKPROF_H
+/*
+Mutex contention profiler for 18.c, 19.c and 20.c, compiled in only with -DLOCK_PROFILE, e.g.
+	gcc -DLOCK_PROFILE -O2 -o 18 18.c -lpthread
+Without the define this header is empty and the programs call pthread directly.
+With it pthread_mutex_lock and pthread_mutex_unlock become macros recording for every mutex (by address) the number of acquisitions, how many of them found the mutex taken, total and max wait and hold time. The lock is first tried with pthread_mutex_trylock, the clock is read for the wait only when that fails, so an uncontended acquisition costs one table lookup and one clock_gettime (start of the hold). The statistics of a mutex are only written by its holder, no extra synchronization is needed.
+A mutex is named by the expression and the place of the first lock call, the report is printed to stderr at exit ranked by total wait time.
+*/
+#ifdef LOCK_PROFILE
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define LOCKPROF_SLOTS 1024
+
+typedef struct lockStats {
+	pthread_mutex_t *mutex;
+	const char *name;
+	const char *file;
+	int line;
+	long acquisitions;
+	long contended;
+	long long waitNs;
+	long long maxWait;
+	long long holdNs;
+	long long maxHold;
+	long long acquiredAt;
+} lockStats_t;
+
+static lockStats_t lockprofTable[LOCKPROF_SLOTS];
+static int lockprofRegistered;
+
+static long long lockprof_now(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (long long)t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+static int lockprof_compare(const void *a, const void *b) {
+	const lockStats_t *x = a, *y = b;
+	if (x->mutex == NULL || y->mutex == NULL) return (x->mutex == NULL) - (y->mutex == NULL);
+	return (x->waitNs < y->waitNs) - (x->waitNs > y->waitNs);
+}
+
+static void lockprof_report(void) {
+	lockStats_t *s;
+	qsort(lockprofTable, LOCKPROF_SLOTS, sizeof(lockStats_t), lockprof_compare);
+	fprintf(stderr, "%4s %-48s %10s %10s %7s %11s %10s %10s %10s\n", "rank", "mutex (first lock)", "acquired", "contended",
+		"%", "wait [ms]", "max [us]", "hold [ns]", "max [us]");
+	for (int i = 0; i < LOCKPROF_SLOTS && lockprofTable[i].mutex; i++) {
+		char site[256];
+		s = &lockprofTable[i];
+		snprintf(site, sizeof(site), "%s %s:%d", s->name, s->file, s->line);
+		fprintf(stderr, "%4d %-48s %10ld %10ld %6.2f%% %11.3f %10.1f %10.0f %10.1f\n", i + 1, site, s->acquisitions, s->contended,
+			s->acquisitions ? 100.0 * s->contended / s->acquisitions : 0.0, s->waitNs * 1e-6, s->maxWait * 1e-3,
+			s->acquisitions ? (double)s->holdNs / s->acquisitions : 0.0, s->maxHold * 1e-3);
+	}
+}
+
+/* Open addressing on the mutex address, a slot is claimed with compare and swap */
+static lockStats_t *lockprof_find(pthread_mutex_t *mutex, const char *name, const char *file, int line) {
+	uintptr_t h = ((uintptr_t)mutex >> 3) * 0x9E3779B97F4A7C15ULL;
+	for (int probe = 0; probe < LOCKPROF_SLOTS; probe++) {
+		lockStats_t *s = &lockprofTable[(h + probe) % LOCKPROF_SLOTS];
+		pthread_mutex_t *key = __atomic_load_n(&s->mutex, __ATOMIC_ACQUIRE);
+		if (key == mutex) return s;
+		if (key == NULL) {
+			if (__atomic_compare_exchange_n(&s->mutex, &key, mutex, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+				s->name = name;
+				s->file = file;
+				s->line = line;
+				if (!__atomic_exchange_n(&lockprofRegistered, 1, __ATOMIC_RELAXED)) atexit(lockprof_report);
+				return s;
+			}
+			if (key == mutex) return s;
+		}
+	}
+	return NULL;
+}
+
+static int lockprof_lock(pthread_mutex_t *mutex, const char *name, const char *file, int line) {
+	lockStats_t *s = lockprof_find(mutex, name, file, line);
+	long long start = 0, now;
+	int err, contended = 0;
+	if ((err = pthread_mutex_trylock(mutex)) == EBUSY) {
+		contended = 1;
+		start = lockprof_now();
+		err = pthread_mutex_lock(mutex);
+	}
+	if (err || s == NULL) return err;
+	now = lockprof_now();
+	s->acquisitions++;
+	if (contended) {
+		s->contended++;
+		s->waitNs += now - start;
+		if (now - start > s->maxWait) s->maxWait = now - start;
+	}
+	s->acquiredAt = now;
+	return 0;
+}
+
+static int lockprof_unlock(pthread_mutex_t *mutex) {
+	lockStats_t *s = lockprof_find(mutex, "?", "?", 0);
+	if (s != NULL && s->acquiredAt) {
+		long long hold = lockprof_now() - s->acquiredAt;
+		s->holdNs += hold;
+		if (hold > s->maxHold) s->maxHold = hold;
+		s->acquiredAt = 0;
+	}
+	return pthread_mutex_unlock(mutex);
+}
+
+#define pthread_mutex_lock(m) lockprof_lock((m), #m, __FILE__, __LINE__)
+#define pthread_mutex_unlock(m) lockprof_unlock(m)
+#endif
+
+#endif